@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lua.h>
+
+// batch rendering: render every job in a manifest, several at a time, from
+// one process that loads the font and sets up lua only once.
+//
+// the manifest has a job per line: the score, the audio or - for none, and
+// the output, separated by whitespace. blank lines and lines starting with
+// # are skipped.
+//
+// jobs are rendered by worker processes forked once everything they share
+// is set up, so that each starts with the font face and the lua state
+// without loading them again, and a job that fails can't take the others
+// down with it. each worker takes the next job from a pipe, and keeps its
+// lua state and cairo's glyph caches from one job to the next, the way
+// --watch does from one edit to the next.
+
+struct job {
+	char *score;
+	char *audio;
+	char *output;
+	char *cache;
+	// whether this is the first job of its score, which alone saves the
+	// layout cache
+	bool savecache;
+};
+
+extern const char *scorepath, *audiopath, *outpath, *cachepath;
+extern bool savecache;
+extern int encthreads;
+
+int loadscore(lua_State *L);
+int runscript(lua_State *L);
+int render(lua_State *L, long first, long last);
+
+static struct job *
+readmanifest(const char *path, int *njobs)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return NULL;
+	}
+
+	struct job *jobs = NULL;
+	int n = 0, cap = 0;
+	char *line = NULL;
+	size_t len = 0;
+	for (int lineno = 1; getline(&line, &len, f) >= 0; lineno++) {
+		char *score = strtok(line, " \t\n");
+		if (!score || *score == '#')
+			continue;
+		char *audio = strtok(NULL, " \t\n");
+		char *output = strtok(NULL, " \t\n");
+		if (!output || strtok(NULL, " \t\n")) {
+			fprintf(stderr, "%s:%d: expected a score, audio and output\n", path, lineno);
+			n = -1;
+			break;
+		}
+
+		if (n == cap) {
+			cap = cap ? 2 * cap : 16;
+			struct job *j = realloc(jobs, cap * sizeof(*j));
+			if (!j) {
+				fprintf(stderr, "out of memory for jobs\n");
+				n = -1;
+				break;
+			}
+			jobs = j;
+		}
+
+		// the layout cache goes next to the score, as it does outside of
+		// a batch
+		struct job *job = &jobs[n++];
+		job->score = strdup(score);
+		job->audio = strcmp(audio, "-") == 0 ? NULL : strdup(audio);
+		job->output = strdup(output);
+		job->cache = malloc(strlen(score) + sizeof(".cache"));
+		if (job->cache)
+			sprintf(job->cache, "%s.cache", score);
+		if (!job->score || (!job->audio && strcmp(audio, "-") != 0) || !job->output || !job->cache) {
+			fprintf(stderr, "out of memory for jobs\n");
+			n = -1;
+			break;
+		}
+
+		// a score listed again, say with other audio, can be rendered by
+		// another worker at the same time, so only the first job saves its
+		// layout. the others still reuse the cache once it is there.
+		job->savecache = true;
+		for (int i = 0; i < n - 1; i++) {
+			if (strcmp(jobs[i].score, job->score) == 0) {
+				job->savecache = false;
+				break;
+			}
+		}
+	}
+
+	free(line);
+	fclose(f);
+	if (n < 0)
+		return NULL;
+	if (n == 0)
+		fprintf(stderr, "no jobs in %s\n", path);
+	*njobs = n;
+	return jobs;
+}
+
+// render the jobs whose numbers come through fd until it is closed,
+// returning whether they all succeeded
+static bool
+worker(lua_State *L, const struct job *jobs, int fd, long first, long last)
+{
+	bool ok = true;
+	int n;
+	while (read(fd, &n, sizeof(n)) == sizeof(n)) {
+		scorepath = jobs[n].score;
+		audiopath = jobs[n].audio;
+		outpath = jobs[n].output;
+		cachepath = jobs[n].cache;
+		savecache = jobs[n].savecache;
+		if (loadscore(L) < 0 || runscript(L) < 0 || render(L, first, last) < 0) {
+			fprintf(stderr, "failed to render %s\n", outpath);
+			ok = false;
+		} else {
+			fprintf(stderr, "rendered %s\n", outpath);
+		}
+	}
+	return ok;
+}
+
+// render every job in manifest with up to workers at a time, returning the
+// exit status for the whole batch
+int
+batch(lua_State *L, const char *manifest, int workers, long first, long last)
+{
+	int njobs;
+	struct job *jobs = readmanifest(manifest, &njobs);
+	if (!jobs)
+		return 1;
+	if (workers > njobs)
+		workers = njobs;
+
+	// left to itself, each worker's encoder would start a thread per core,
+	// so the cores are split between them instead
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	encthreads = cores > workers ? cores / workers : 1;
+
+	// job numbers are written one at a time, and writes to a pipe smaller
+	// than PIPE_BUF are never split, so workers reading it at the same time
+	// each get whole ones
+	int fds[2];
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "failed to create job pipe: %s\n", strerror(errno));
+		return 1;
+	}
+
+	// anything still buffered would otherwise be written by every worker
+	fflush(NULL);
+
+	int started = 0;
+	for (; started < workers; started++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "failed to start worker: %s\n", strerror(errno));
+			break;
+		}
+		if (pid == 0) {
+			close(fds[1]);
+			bool ok = worker(L, jobs, fds[0], first, last);
+			fflush(NULL);
+			_exit(ok ? 0 : 1);
+		}
+	}
+	close(fds[0]);
+
+	// if every worker has died, writing the rest fails instead of killing
+	// us, and those jobs are counted as failed
+	signal(SIGPIPE, SIG_IGN);
+	int sent = 0;
+	for (; started && sent < njobs; sent++) {
+		if (write(fds[1], &sent, sizeof(sent)) != sizeof(sent))
+			break;
+	}
+	close(fds[1]);
+
+	bool ok = sent == njobs;
+	int status;
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = false;
+	}
+
+	if (sent < njobs)
+		fprintf(stderr, "%d of %d jobs never started\n", njobs - sent, njobs);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// generate a synthetic score for benchmarking.
+//
+// every staff gets the given number of voices, each of which is a run of
+// 4/4 measures made of one beat at a time: a quarter note, a quarter rest,
+// a beamed group of eighths or sixteenths, or a triplet of eighths. any
+// note outside a triplet may be a chord instead. notes are timed at a fixed
+// tempo, so the animation runs for measures * 4 * beat seconds.
+//
+// the same options always give the same score, since the random numbers
+// come from a generator of our own rather than the C library's. the number
+// of notes is printed to stderr for working out throughput.
+
+struct options {
+	int measures;
+	int voices;
+	int staves;
+	double chords;
+	double beams;
+	double tuplets;
+	double beat;
+	uint64_t seed;
+};
+
+static uint64_t state;
+static long notes;
+
+// xorshift64*
+static double
+uniform(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return (state * 0x2545f4914f6cdd1d >> 11) * 0x1.0p-53;
+}
+
+static bool
+chance(double p)
+{
+	return uniform() < p;
+}
+
+static int
+pick(int n)
+{
+	return uniform() * n;
+}
+
+// the name of staff s. layout scrolls along the notes of the staff named
+// low, so that is the name of the last one.
+static const char *
+staffname(const struct options *o, int s)
+{
+	static char name[] = "staffa";
+	if (s == o->staves - 1)
+		return "low";
+	name[5] = 'a' + s;
+	return name;
+}
+
+// print a note starting at time, moving the octave by at most one so that
+// the voice wanders around the staff without leaving it
+static void
+note(double time, int *octave)
+{
+	int shift = 0;
+	if (*octave > 0 || (*octave == 0 && chance(.2)))
+		shift = chance(.5) ? -1 : 0;
+	else if (*octave < 0 || chance(.25))
+		shift = chance(.5) ? 1 : 0;
+	*octave += shift;
+
+	printf("%.3f%c", time, "abcdefg"[pick(7)]);
+	if (chance(.1))
+		putchar(chance(.5) ? 's' : 'f');
+	if (shift)
+		putchar(shift > 0 ? '\'' : ',');
+
+	notes++;
+}
+
+// print a note, or a chord with probability chords, with its stem
+// direction, count and beam mark
+static void
+column(double chords, double time, int *octave, const char *stem, int count, const char *beam)
+{
+	if (chance(chords)) {
+		int n = 2 + pick(3);
+		putchar('<');
+		for (int i = 0; i < n; i++) {
+			if (i)
+				putchar(' ');
+			note(time, octave);
+		}
+		putchar('>');
+	} else {
+		note(time, octave);
+	}
+	printf("%s%d%s", stem, count, beam);
+}
+
+static void
+voice(const struct options *o, int staff, int v)
+{
+	// stems go up for the first voice on a staff and down for the second,
+	// and are left to layout when a staff has a single voice
+	const char *stem = o->voices == 1 ? "" : v % 2 ? "v" : "^";
+	int octave = 0;
+
+	printf("\\voice\n\t\\staff %s\n\t\\clef %s\n\t\\time 4/4\n",
+		staffname(o, staff), staff % 2 ? "bass" : "treble");
+
+	for (int m = 0; m < o->measures; m++) {
+		putchar('\t');
+		for (int b = 0; b < 4; b++) {
+			double time = (m * 4 + b) * o->beat;
+			if (chance(o->tuplets)) {
+				// the parser doesn't take chords in a tuplet
+				printf("t3/2{");
+				for (int i = 0; i < 3; i++) {
+					if (i)
+						putchar(' ');
+					column(0, time + i * o->beat / 3, &octave, stem, 8, i == 0 ? "[" : i == 2 ? "]" : "");
+				}
+				printf("}");
+			} else if (chance(o->beams)) {
+				int n = chance(.5) ? 2 : 4;
+				for (int i = 0; i < n; i++) {
+					if (i)
+						putchar(' ');
+					column(o->chords, time + i * o->beat / n, &octave, stem, 4 * n, i == 0 ? "[" : i == n - 1 ? "]" : "");
+				}
+			} else if (chance(.1)) {
+				printf("s4");
+			} else {
+				column(o->chords, time, &octave, stem, 4, "");
+			}
+			putchar(' ');
+		}
+		printf("|\n");
+	}
+
+	printf("\\end\n\n");
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-m measures] [-v voices per staff] [-s staves] [-c chord density] "
+		"[-b beam density] [-t tuplet density] [-T seconds per beat] [-r seed]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct options o = {
+		.measures = 64,
+		.voices = 1,
+		.staves = 2,
+		.chords = .2,
+		.beams = .3,
+		.tuplets = .05,
+		.beat = .5,
+		.seed = 1,
+	};
+
+	int c;
+	while ((c = getopt(argc, argv, "m:v:s:c:b:t:T:r:")) != -1) {
+		switch (c) {
+		case 'm': o.measures = atoi(optarg); break;
+		case 'v': o.voices = atoi(optarg); break;
+		case 's': o.staves = atoi(optarg); break;
+		case 'c': o.chords = atof(optarg); break;
+		case 'b': o.beams = atof(optarg); break;
+		case 't': o.tuplets = atof(optarg); break;
+		case 'T': o.beat = atof(optarg); break;
+		case 'r': o.seed = strtoull(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || o.measures < 1 || o.voices < 1 || o.staves < 1 || o.staves > 26 || o.beat <= 0)
+		usage(argv[0]);
+
+	// xorshift gets stuck at zero
+	state = o.seed ? o.seed : 1;
+
+	for (int s = 0; s < o.staves; s++) {
+		for (int v = 0; v < o.voices; v++)
+			voice(&o, s, v);
+	}
+
+	printf("\\layout\n");
+	for (int s = 0; s < o.staves; s++)
+		printf("\t\\staff %s\n", staffname(&o, s));
+	printf("\\end\n");
+
+	fprintf(stderr, "notes %ld\n", notes);
+
+	return 0;
+}
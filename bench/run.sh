@@ -0,0 +1,58 @@
+#!/bin/sh
+# time parse and layout and a fixed run of frames on synthetic scores at
+# several resolutions, printing the throughput of each.
+#
+# usage: bench/run.sh [frames]
+#
+# every run starts without a layout cache, so that layout is always timed,
+# and renders the frames from two seconds in, once the first notes are up.
+# frames are drawn and converted but not encoded, so that the encoder
+# doesn't drown out the cost of drawing.
+#
+# memory is reported as the MB lua and the rationals allocated over the
+# run, their peaks, and the peak rss of the process, which also counts the
+# mapped score, cairo's surfaces and the font.
+
+frames=${1:-120}
+root=$(cd "$(dirname "$0")/.." && pwd)
+smallpond=$root/smallpond
+genscore=$root/bench/genscore
+
+# name and generator options of each score
+scores="
+small -m 32 -s 1
+medium -m 128 -s 2 -c .3 -b .4 -t .1
+dense -m 128 -s 4 -v 2 -c .6 -b .6 -t .2
+"
+sizes="1280x720 1920x1080 3840x2160"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+printf '%-8s %10s %7s %12s %12s %10s %10s %9s %8s %8s %8s\n' score size notes "layout ms" "notes/s" frames "frames/s" "alloc MB" "lua MB" "rat MB" "rss MB"
+echo "$scores" | while read -r name args; do
+	[ -n "$name" ] || continue
+	# shellcheck disable=SC2086
+	notes=$("$genscore" $args 2>&1 >score.sp | awk '$1 == "notes" { print $2 }')
+	for size in $sizes; do
+		rm -f score.sp.cache
+		if ! "$smallpond" --script "$root/smallpond.lua" --audio - --null-output --size "$size" --start 2 --end "$(awk "BEGIN { print 2 + $frames / 60 }")" --timing --memory 2>log; then
+			cat log >&2
+			exit 1
+		fi
+		awk -v name="$name" -v size="$size" -v notes="$notes" '
+			$1 == "peak" && $2 == "rss" { rss = $3 }
+			$1 == "peak" && $2 == "memory" { lua = $3; rat = $6 }
+			# the phases of --memory, and then of --timing
+			$1 == "phase" { memory = $2 == "allocs" }
+			memory && NF == 5 { alloc += $3 }
+			!memory && $1 == "script" && NF == 2 { layout = $2 }
+			$2 == "frames" { frames = $1 }
+			$1 == "total" && !total { total = $2 }
+			END {
+				printf "%-8s %10s %7d %12.1f %12.0f %10d %10.1f %9.1f %8.1f %8.1f %8.1f\n", name, size, notes,
+					layout, notes / (layout / 1000), frames, frames / (total / 1000), alloc, lua, rat, rss
+			}' log
+	done
+done
@@ -0,0 +1,346 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// binary cache of the laid-out display list.
+//
+// the file starts with a header holding a magic string, the format version
+// and two keys: a hash of what the layout depends on besides the score,
+// which is the binary, layout.lua and the font, and a hash of the score. a
+// cache whose score key doesn't match is still useful, since layout can
+// reuse the parts of it before the first edit. the header is followed by a
+// single encoded value:
+//
+//   'f', 't'               false, true
+//   'i' int64              integer
+//   'n' double             number
+//   's' uint32 bytes...    string
+//   'T' uint32 uint32 ...  table with an array part and a hash part, followed
+//                          by the array values and then key/value pairs
+//
+// all values are stored in host byte order, since the cache is only ever
+// read back on the machine that wrote it.
+
+#define CACHE_MAGIC "spcache"
+// only the format is versioned: changes to the code the layout comes from
+// change the code key instead
+#define CACHE_VERSION 2
+#define CACHE_MAXDEPTH 64
+
+uint64_t
+cache_hash(uint64_t h, const void *data, size_t len)
+{
+	// FNV-1a
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+uint64_t
+cache_hashfile(uint64_t h, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return cache_hash(h, path, strlen(path));
+
+	char buf[BUFSIZ];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		h = cache_hash(h, buf, n);
+	fclose(f);
+
+	return h;
+}
+
+struct reader {
+	const char *p;
+	const char *end;
+};
+
+static bool
+get(struct reader *r, void *out, size_t len)
+{
+	if ((size_t)(r->end - r->p) < len)
+		return false;
+	memcpy(out, r->p, len);
+	r->p += len;
+	return true;
+}
+
+// decode a value and push it, returning false if the data is malformed
+static bool
+decode(lua_State *L, struct reader *r, int depth)
+{
+	char tag;
+	if (depth > CACHE_MAXDEPTH || !get(r, &tag, 1))
+		return false;
+
+	if (!lua_checkstack(L, 3))
+		return false;
+
+	switch (tag) {
+	case 'f':
+	case 't':
+		lua_pushboolean(L, tag == 't');
+		return true;
+	case 'i': {
+		int64_t i;
+		if (!get(r, &i, sizeof(i)))
+			return false;
+		lua_pushinteger(L, i);
+		return true;
+	}
+	case 'n': {
+		double n;
+		if (!get(r, &n, sizeof(n)))
+			return false;
+		lua_pushnumber(L, n);
+		return true;
+	}
+	case 's': {
+		uint32_t len;
+		if (!get(r, &len, sizeof(len)) || (size_t)(r->end - r->p) < len)
+			return false;
+		lua_pushlstring(L, r->p, len);
+		r->p += len;
+		return true;
+	}
+	case 'T': {
+		uint32_t narr, nhash;
+		if (!get(r, &narr, sizeof(narr)) || !get(r, &nhash, sizeof(nhash)))
+			return false;
+		// every entry takes at least a byte, so don't trust larger sizes
+		if (narr > (size_t)(r->end - r->p) || nhash > (size_t)(r->end - r->p))
+			return false;
+		lua_createtable(L, narr, nhash);
+		for (uint32_t i = 1; i <= narr; i++) {
+			if (!decode(L, r, depth + 1))
+				return false;
+			lua_rawseti(L, -2, i);
+		}
+		for (uint32_t i = 0; i < nhash; i++) {
+			if (!decode(L, r, depth + 1) || !decode(L, r, depth + 1))
+				return false;
+			if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2)))
+				return false;
+			lua_rawset(L, -3);
+		}
+		return true;
+	}
+	}
+
+	return false;
+}
+
+struct writer {
+	FILE *f;
+	// error message, which may use the type name of the offending value
+	const char *err;
+	int type;
+};
+
+static void
+put(struct writer *w, const void *data, size_t len)
+{
+	fwrite(data, 1, len, w->f);
+}
+
+static bool
+isarraykey(lua_State *L, int idx, uint32_t narr)
+{
+	return lua_isinteger(L, idx) && lua_tointeger(L, idx) >= 1 && lua_tointeger(L, idx) <= narr;
+}
+
+// encode the value at index idx, returning false and setting w->err on
+// failure
+static bool
+encode(lua_State *L, struct writer *w, int idx, int depth)
+{
+	idx = lua_absindex(L, idx);
+	if (depth > CACHE_MAXDEPTH || !lua_checkstack(L, 3)) {
+		w->err = "display list too deeply nested";
+		return false;
+	}
+
+	switch (lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+		put(w, lua_toboolean(L, idx) ? "t" : "f", 1);
+		return true;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			int64_t i = lua_tointeger(L, idx);
+			put(w, "i", 1);
+			put(w, &i, sizeof(i));
+		} else {
+			double n = lua_tonumber(L, idx);
+			put(w, "n", 1);
+			put(w, &n, sizeof(n));
+		}
+		return true;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *s = lua_tolstring(L, idx, &len);
+		uint32_t len32 = len;
+		put(w, "s", 1);
+		put(w, &len32, sizeof(len32));
+		put(w, s, len);
+		return true;
+	}
+	case LUA_TTABLE: {
+		uint32_t narr = lua_rawlen(L, idx), nhash = 0;
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			lua_pop(L, 1);
+			if (!isarraykey(L, -1, narr))
+				nhash++;
+		}
+
+		put(w, "T", 1);
+		put(w, &narr, sizeof(narr));
+		put(w, &nhash, sizeof(nhash));
+
+		for (uint32_t i = 1; i <= narr; i++) {
+			lua_rawgeti(L, idx, i);
+			bool ok = encode(L, w, -1, depth + 1);
+			lua_pop(L, 1);
+			if (!ok)
+				return false;
+		}
+
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			if (!isarraykey(L, -2, narr) &&
+					(!encode(L, w, -2, depth + 1) || !encode(L, w, -1, depth + 1))) {
+				lua_pop(L, 2);
+				return false;
+			}
+			lua_pop(L, 1);
+		}
+		return true;
+	}
+	}
+
+	w->err = "cannot cache a %s";
+	w->type = lua_type(L, idx);
+	return false;
+}
+
+// cache_load() -> display list and whether it is for the current score, or
+// nil if there is no valid cache
+// the path, code key and score key of the cache are upvalues
+int
+cache_load(lua_State *L)
+{
+	const char *path = lua_tostring(L, lua_upvalueindex(1));
+	uint64_t codekey = lua_tointeger(L, lua_upvalueindex(2));
+	uint64_t scorekey = lua_tointeger(L, lua_upvalueindex(3));
+
+	if (!path)
+		return 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+
+	struct reader r = {data, data + st.st_size};
+	char magic[sizeof(CACHE_MAGIC)];
+	uint32_t version;
+	uint64_t filecodekey, filescorekey;
+	bool ok = get(&r, magic, sizeof(magic)) && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 &&
+		get(&r, &version, sizeof(version)) && version == CACHE_VERSION &&
+		get(&r, &filecodekey, sizeof(filecodekey)) && filecodekey == codekey &&
+		get(&r, &filescorekey, sizeof(filescorekey));
+
+	int top = lua_gettop(L);
+	if (ok && !decode(L, &r, 0)) {
+		lua_settop(L, top);
+		ok = false;
+	}
+
+	munmap((void *)data, st.st_size);
+
+	if (!ok)
+		return 0;
+
+	lua_pushboolean(L, filescorekey == scorekey);
+	return 2;
+}
+
+// cache_save(display) -> true, or nil and an error message
+int
+cache_save(lua_State *L)
+{
+	const char *path = lua_tostring(L, lua_upvalueindex(1));
+	uint64_t codekey = lua_tointeger(L, lua_upvalueindex(2));
+	uint64_t scorekey = lua_tointeger(L, lua_upvalueindex(3));
+
+	luaL_checkany(L, 1);
+	if (!path) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no cache path");
+		return 2;
+	}
+
+	// write to a temporary file first so a reader never sees a partial
+	// cache. its name is unique, so that processes rendering the same score
+	// don't write over each other's, and whichever renames last wins.
+	char *tmp = lua_newuserdata(L, strlen(path) + sizeof(".XXXXXX"));
+	sprintf(tmp, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (!f) {
+		if (fd >= 0) {
+			close(fd);
+			remove(tmp);
+		}
+		lua_pushnil(L);
+		lua_pushfstring(L, "couldn't create %s", tmp);
+		return 2;
+	}
+
+	struct writer w = {f, NULL, LUA_TNONE};
+	uint32_t version = CACHE_VERSION;
+	put(&w, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	put(&w, &version, sizeof(version));
+	put(&w, &codekey, sizeof(codekey));
+	put(&w, &scorekey, sizeof(scorekey));
+
+	encode(L, &w, 1, 0);
+	if (fclose(f) != 0 && !w.err)
+		w.err = "failed to write cache";
+	if (!w.err && rename(tmp, path) != 0)
+		w.err = "failed to replace cache";
+
+	if (w.err) {
+		remove(tmp);
+		lua_pushnil(L);
+		lua_pushfstring(L, w.err, lua_typename(L, w.type));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
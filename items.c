@@ -0,0 +1,285 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// native store for the drawable items of a staff.
+//
+// layout builds a table per item, with another table for its times, which
+// costs hundreds of bytes per notehead and a lot of pointer chasing to draw.
+// the store instead keeps one packed array per field, so an item takes a
+// few dozen bytes and drawing walks the arrays in order. lines and quads
+// keep their points after the first in a separate array of points.
+
+#define ITEMS "smallpond.items"
+
+enum {
+	ITEM_GLYPH,
+	ITEM_LINE,
+	ITEM_CIRCLE,
+	ITEM_QUAD,
+};
+
+struct items {
+	size_t len;
+	size_t cap;
+	uint8_t *kind;
+	uint32_t *glyph;
+	// glyph size, line thickness or circle radius
+	double *size;
+	// position of a glyph or circle, or the first point of a line or quad
+	double *x;
+	double *y;
+	// animation times, NaN for items that are never drawn
+	double *start;
+	double *stop;
+	// index in points of the remaining points of a line or quad
+	uint32_t *rest;
+
+	size_t npoints;
+	size_t pointcap;
+	double *points;
+};
+
+void drawglyph(double size, unsigned int glyph, double x, double y);
+void drawline(double t, double x1, double y1, double x2, double y2);
+void drawcircle(double r, double x, double y);
+void drawquad(double x1, double y1, double x2, double y2, double x3, double y3, double x4, double y4);
+void pushtransform(double scale, double x, double y);
+void poptransform(void);
+
+extern unsigned long luacalls;
+
+static bool
+grow(void **p, size_t cap, size_t size)
+{
+	void *n = realloc(*p, cap * size);
+	if (!n)
+		return false;
+	*p = n;
+	return true;
+}
+
+// append an item, returning its index
+static size_t
+additem(lua_State *L, struct items *it, int kind, int npoints)
+{
+	if (it->len == it->cap) {
+		size_t cap = it->cap ? 2 * it->cap : 256;
+		if (!grow((void **)&it->kind, cap, sizeof(*it->kind)) ||
+				!grow((void **)&it->glyph, cap, sizeof(*it->glyph)) ||
+				!grow((void **)&it->size, cap, sizeof(*it->size)) ||
+				!grow((void **)&it->x, cap, sizeof(*it->x)) ||
+				!grow((void **)&it->y, cap, sizeof(*it->y)) ||
+				!grow((void **)&it->start, cap, sizeof(*it->start)) ||
+				!grow((void **)&it->stop, cap, sizeof(*it->stop)) ||
+				!grow((void **)&it->rest, cap, sizeof(*it->rest)))
+			luaL_error(L, "out of memory");
+		it->cap = cap;
+	}
+
+	// the first point goes in x and y, and only the rest in points
+	size_t rest = 2 * (npoints - 1);
+	if (it->npoints + rest > it->pointcap) {
+		size_t cap = it->pointcap ? 2 * it->pointcap : 256;
+		if (!grow((void **)&it->points, cap, sizeof(*it->points)))
+			luaL_error(L, "out of memory");
+		it->pointcap = cap;
+	}
+
+	size_t i = it->len++;
+	it->kind[i] = kind;
+	it->glyph[i] = 0;
+	it->size[i] = 0;
+	it->rest[i] = it->npoints;
+	it->npoints += rest;
+
+	return i;
+}
+
+// read the points from index arg on into the item, followed by its start
+// and stop times
+static void
+setpoints(lua_State *L, struct items *it, size_t i, int arg, int npoints)
+{
+	it->x[i] = luaL_checknumber(L, arg);
+	it->y[i] = luaL_checknumber(L, arg + 1);
+	for (int j = 0; j < 2 * (npoints - 1); j++)
+		it->points[it->rest[i] + j] = luaL_checknumber(L, arg + 2 + j);
+
+	arg += 2 * npoints;
+	it->start[i] = luaL_optnumber(L, arg, NAN);
+	it->stop[i] = luaL_optnumber(L, arg + 1, NAN);
+}
+
+// items_new() -> store
+int
+items_new(lua_State *L)
+{
+	struct items *it = lua_newuserdata(L, sizeof(*it));
+	*it = (struct items){0};
+	luaL_setmetatable(L, ITEMS);
+	return 1;
+}
+
+// store:glyph(size, glyph, x, y, [start], [stop])
+static int
+Lglyph(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	size_t i = additem(L, it, ITEM_GLYPH, 1);
+	luacalls++;
+	it->size[i] = luaL_checknumber(L, 2);
+	it->glyph[i] = luaL_checknumber(L, 3);
+	setpoints(L, it, i, 4, 1);
+	return 0;
+}
+
+// store:line(t, x1, y1, x2, y2, [start], [stop])
+static int
+Lline(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	size_t i = additem(L, it, ITEM_LINE, 2);
+	luacalls++;
+	it->size[i] = luaL_checknumber(L, 2);
+	setpoints(L, it, i, 3, 2);
+	return 0;
+}
+
+// store:circle(r, x, y, [start], [stop])
+static int
+Lcircle(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	size_t i = additem(L, it, ITEM_CIRCLE, 1);
+	luacalls++;
+	it->size[i] = luaL_checknumber(L, 2);
+	setpoints(L, it, i, 3, 1);
+	return 0;
+}
+
+// store:quad(x1, y1, x2, y2, x3, y3, x4, y4, [start], [stop])
+static int
+Lquad(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	size_t i = additem(L, it, ITEM_QUAD, 4);
+	luacalls++;
+	setpoints(L, it, i, 2, 4);
+	return 0;
+}
+
+// how far along a line drawn from a to b should be after delta of its
+// animation, never overshooting b
+static double
+along(double a, double b, double delta)
+{
+	double end = a + delta*(b - a);
+	if (a < b)
+		return b < end ? b : end;
+	else
+		return end < b ? b : end;
+}
+
+// store:draw(time, scale, toff, xmin, ymin, yoff)
+// draw every item that has started by time. the staff's extent and the
+// scroll offset are applied once as a transformation, so the items are
+// drawn in layout coordinates.
+static int
+Ldraw(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	double time = luaL_checknumber(L, 2);
+	double scale = luaL_checknumber(L, 3);
+	double toff = luaL_checknumber(L, 4);
+	double xmin = luaL_checknumber(L, 5);
+	double ymin = luaL_checknumber(L, 6);
+	double yoff = luaL_checknumber(L, 7);
+
+	luacalls++;
+	pushtransform(scale, scale*(toff - xmin), scale*(yoff - ymin));
+
+	for (size_t i = 0; i < it->len; i++) {
+		if (!(it->start[i] < time))
+			continue;
+
+		double x = it->x[i], y = it->y[i];
+		const double *p = it->points + it->rest[i];
+		switch (it->kind[i]) {
+		case ITEM_GLYPH:
+			drawglyph(it->size[i], it->glyph[i], x, y);
+			break;
+		case ITEM_LINE: {
+			double delta = (time - it->start[i]) / (it->stop[i] - it->start[i]);
+			drawline(it->size[i], x, y, along(x, p[0], delta), along(y, p[1], delta));
+			break;
+		}
+		case ITEM_CIRCLE:
+			drawcircle(it->size[i], x, y);
+			break;
+		case ITEM_QUAD:
+			drawquad(x, y, p[0], p[1], p[2], p[3], p[4], p[5]);
+			break;
+		}
+	}
+
+	poptransform();
+
+	return 0;
+}
+
+static int
+Llen(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	lua_pushinteger(L, it->len);
+	return 1;
+}
+
+static int
+Lgc(lua_State *L)
+{
+	struct items *it = luaL_checkudata(L, 1, ITEMS);
+	free(it->kind);
+	free(it->glyph);
+	free(it->size);
+	free(it->x);
+	free(it->y);
+	free(it->start);
+	free(it->stop);
+	free(it->rest);
+	free(it->points);
+	*it = (struct items){0};
+	return 0;
+}
+
+static const luaL_Reg methods[] = {
+	{"glyph", Lglyph},
+	{"line", Lline},
+	{"circle", Lcircle},
+	{"quad", Lquad},
+	{"draw", Ldraw},
+	{NULL, NULL},
+};
+
+static const luaL_Reg metamethods[] = {
+	{"__len", Llen},
+	{"__gc", Lgc},
+	{NULL, NULL},
+};
+
+// register the metatable of stores
+void
+items_open(lua_State *L)
+{
+	luaL_newmetatable(L, ITEMS);
+	luaL_setfuncs(L, metamethods, 0);
+	lua_newtable(L);
+	luaL_setfuncs(L, methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
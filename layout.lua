@@ -0,0 +1,963 @@
+-- parse
+local em = 8
+
+local Glyph = {
+	["noteheadWhole"] = 0xE0A2,
+	["noteheadHalf"] = 0xE0A3,
+	["noteheadBlack"] = 0xE0A4,
+	["flag8thDown"] = 0xE241,
+	["flag8thUp"] = 0xE240,
+	["accidentalFlat"] = 0xE260,
+	["accidentalNatural"] = 0xE261,
+	["accidentalSharp"] = 0xE262,
+	["gClef"] = 0xE050,
+	["fClef"] = 0xE062,
+}
+
+local Clef = {
+	["treble"] = {
+		glyph = Glyph.gClef,
+		yoff = 3*em,
+		defoctave = 4,
+		place = function(char, octave)
+			local defoctave = 4 -- TODO: how do we use the value above?
+			local NOTES = "abcdefg"
+			local s, _ = string.find(NOTES, char)
+			return (octave - defoctave) * 7 + 2 - s
+		end
+	},
+	["bass"] = {
+		glyph = Glyph.fClef,
+		yoff = em,
+		defoctave = 3,
+		place = function(char, octave)
+			local defoctave = 3 -- TODO: how do we use the value above?
+			local NOTES = "abcdefg"
+			local s, _ = string.find(NOTES, char)
+			return (octave - defoctave) * 7 + 4 - s
+		end
+	}
+}
+
+local numerals = {
+	['0'] = 0xE080,
+	['1'] = 0xE081,
+	['2'] = 0xE082,
+	['3'] = 0xE083,
+	['4'] = 0xE084,
+	['5'] = 0xE085,
+	['6'] = 0xE086,
+	['7'] = 0xE087,
+	['8'] = 0xE088,
+	['9'] = 0xE089
+}
+
+-- the parser is implemented natively in parse.c and reads the score that
+-- main.c mapped in. placement below consumes it a measure at a time.
+local stafforder = {}
+
+-- the display list of a previous layout, if any. everything laid out before
+-- the first measure that differs from it is reused.
+local previous = ...
+
+local time = Q.new(0)
+local octave = 0
+local clef = Clef.treble
+local lastnote = nil
+local staff1 = {}
+local points = {}
+local pointindices = {}
+
+function point(t)
+	-- equal rationals are different objects, so index them by their string
+	-- form, which is always reduced
+	local key = Q.tostring(t)
+	if pointindices[key] then
+		return pointindices[key]
+	end
+
+	-- time is updated in place, so keep a copy
+	t = Q.set(Q.new(0), t)
+	table.insert(points, t)
+	pointindices[key] = #points
+	return pointindices[key]
+end
+
+local clefname = function(class)
+	for name, c in pairs(Clef) do
+		if c == class then
+			return name
+		end
+	end
+end
+
+local timings = {}
+local curname
+local inbeam = false
+local beam
+local beams = {}
+local beamednotes
+local unterminated_ties = {}
+local ties = {}
+local lastbarline
+-- first-order placement
+local dispatch1 = {
+	newnotegroup = function(data)
+		local heads = {}
+		local realbeamcount = math.log(data.count) / math.log(2) - 2
+		local beamcount
+		if inbeam then
+			beamcount = math.min(realbeamcount, beamednotes[#beamednotes].realcount)
+		else
+			beamcount = realbeamcount
+		end
+		local maxtime, mintime
+		local lasthead
+		local flipped = false
+		for _, note in ipairs(data.notes) do
+			octave = octave - note.shift
+			local head = {acc=note.acc, y=clef.place(note.note, octave), time=note.time, flip}
+
+			-- avoid overlapping heads by "flipping" head across stem
+			if lasthead and math.abs(head.y - lasthead.y) == 1 then
+				flipped = true
+				if head.y % 2 == 1 then
+					head.flip = true
+				else
+					lasthead.flip = true
+				end
+			end
+			lasthead = head
+			table.insert(heads, head)
+			if note.time and not maxtime then maxtime = note.time end
+			if maxtime and note.time and note.time > maxtime then maxtime = note.time end
+
+			if note.time and not mintime then mintime = note.time end
+			if maxtime and note.time and note.time < maxtime then maxtime = note.time end
+
+			if unterminated_ties[curname] and unterminated_ties[curname].y == head.y then
+				table.insert(ties, {staff=curname, start=unterminated_ties[curname], stop=head})
+				unterminated_ties[curname] = nil
+			end
+
+			if note.tie then
+				assert(unterminated_ties[curname] == nil)
+				unterminated_ties[curname] = head
+			end
+		end
+
+
+		local index = point(time)
+		if flipped and maxtime then timings[index].flipped = true end
+		if not timings[index].mintime then
+			timings[index].mintime = mintime
+		else
+			timings[index].mintime = math.min(mintime, timings[index].mintime)
+		end
+
+		local incr = Q.new(1) / Q.new(data.count)
+		if data.dot then
+			incr = 3*incr / 2
+		end
+		if data.tuplet then incr = incr * data.tuplet end
+
+		local stemlen
+		if data.grace then
+			stemlen = 2.5
+		else
+			stemlen = 3.5
+		end
+		local note = {kind="notecolumn", stemdir=data.stemdir, stemlen=stemlen, dot=data.dot, grace=data.grace, count=incr, length=data.count, time=maxtime, heads=heads, staff=curname}
+		if data.beam == 1 then
+			assert(not inbeam)
+			beamednotes = {}
+			table.insert(beams, beamednotes)
+			table.insert(beamednotes, {note=note, count=beamcount, realcount=realbeamcount})
+			beamednotes.start = Q.set(Q.new(0), time)
+			if data.grace then beamednotes.grace = data.grace end
+			beamednotes.maxbeams = beamcount
+			note.beamgroup = beamednotes
+			inbeam = true
+		elseif data.beam == -1 then
+			assert(inbeam)
+			inbeam = false
+			table.insert(beamednotes, {note=note, count=beamcount, realcount=realbeamcount})
+			beamednotes.maxbeams = math.max(beamednotes.maxbeams, beamcount)
+			note.beamgroup = beamednotes
+		elseif inbeam then
+			beamednotes.maxbeams = math.max(beamednotes.maxbeams, beamcount)
+			table.insert(beamednotes, {note=note, count=beamcount, realcount=realbeamcount})
+			note.beamgroup = beamednotes
+		end
+
+		table.insert(staff1[curname], note)
+
+		local index = point(time)
+		if note.grace then
+			table.insert(timings[index].staffs[curname].pre, note)
+		else
+			table.insert(timings[index].staffs[curname].on, note)
+			Q.addto(time, incr)
+		end
+		lastnote = note
+	end,
+	changeclef = function(data)
+		local class = assert(Clef[data.kind])
+		local clefitem = {kind="clef", class=class}
+		local index = point(time)
+		timings[index].staffs[curname].clef = clefitem
+		table.insert(staff1[curname], clefitem)
+
+		clef = class
+		octave = class.defoctave
+	end,
+	changestaff = function(data)
+		if staff1[data.name] == nil then
+			staff1[data.name] = {}
+		end
+		curname = data.name
+
+		-- mark cross staff beams for special treatment later
+		if inbeam then beamednotes.cross = true end
+	end,
+	changetime = function(data)
+		local timesig = {kind="time", num=data.num, denom=data.denom}
+		local index = point(time)
+		timings[index].staffs[curname].timesig = timesig
+		table.insert(staff1[curname], timesig)
+	end,
+	barline = function(data)
+		local index = point(time)
+		timings[index].barline = true
+		lastbarline = index
+		lastnote = nil
+	end,
+	srest = function(data)
+		table.insert(staff1[curname], {kind='srest', length=data.count, time=Q.set(Q.new(0), time)})
+		Q.addto(time, 1 / Q.new(data.count))
+	end,
+}
+
+-- a hash of the source of each measure of each voice, and the earliest
+-- time at which it differs from the previous layout
+local measures = {}
+local changed
+local change = function(t)
+	if not changed or t < changed then
+		changed = Q.set(Q.new(0), t)
+	end
+end
+
+-- placement state that carries over from one voice into the next
+local entrystate = function()
+	local pending = {}
+	for staff, head in pairs(unterminated_ties) do
+		table.insert(pending, staff .. "=" .. head.y)
+	end
+	table.sort(pending)
+	return table.concat({octave, clefname(clef), tostring(curname), tostring(inbeam), table.concat(pending, ",")}, " ")
+end
+
+local prevmeasures = previous and previous.measures or {}
+local dirty = {}
+local stops = {}
+local lastvoice
+-- measures are parsed as placement asks for them, so only one measure's
+-- parse tables are held at a time. what placement builds from them, in
+-- timings, points and staff1, is kept for the whole piece: the voices come
+-- one after another, each merged into the time points of those before it,
+-- so none of it is done with until the last voice is placed, and layout
+-- starts only then. the memory used by each is told apart around the call
+-- to the parser.
+local nextmeasure = parse_measures(stafforder)
+local parsed = function()
+	memory_phase("parse")
+	local voice, measure, hash = nextmeasure()
+	memory_phase("placement")
+	return voice, measure, hash
+end
+for voice, measure, hash in parsed do
+	if voice ~= lastvoice then
+		time = Q.new(0)
+		lastvoice = voice
+		-- time is updated in place, so this ends up as the end of the voice
+		stops[voice] = time
+		measures[voice] = {entry=entrystate()}
+		if not prevmeasures[voice] or prevmeasures[voice].entry ~= measures[voice].entry then
+			dirty[voice] = true
+			change(time)
+		end
+	end
+
+	local m = measures[voice]
+	table.insert(m, hash)
+	if not dirty[voice] and prevmeasures[voice][#m] ~= hash then
+		dirty[voice] = true
+		-- the stem direction of a beam depends on all of its notes
+		if inbeam then
+			change(beamednotes.start)
+		else
+			change(time)
+		end
+	end
+
+	for _, item in ipairs(measure) do
+		local index = point(time)
+		if not timings[index] then timings[index] = {staffs={}} end
+		if curname and not timings[index].staffs[curname] then timings[index].staffs[curname] = {pre={}, on={}, post={}} end
+		assert(dispatch1[item.command])(item)
+	end
+end
+
+-- measures or whole voices removed from the end
+for voice, old in pairs(prevmeasures) do
+	if not measures[voice] then
+		change(Q.new(0))
+	elseif not dirty[voice] and #old > #measures[voice] then
+		change(stops[voice])
+	end
+end
+
+Q.sort(points)
+
+for _, beam in pairs(beams) do
+	-- check which way the stem should point on all the notes in the beam
+	local ysum = 0
+	for _, entry in ipairs(beam) do
+		-- FIXME: note.heads[1].y is wrong
+		ysum = ysum + entry.note.heads[1].y
+	end
+
+	local stemdir
+	if ysum >= 0 then
+		stemdir = -1
+	else
+		stemdir = 1
+	end
+
+	-- check that stem direction hasn't been set manually
+	local unset = true
+	for _, entry in ipairs(beam) do
+		if entry.note.stemdir then
+			unset = false
+			break
+		end
+	end
+
+	-- update the stem direction
+	if unset then
+		for _, entry in ipairs(beam) do
+			entry.note.stemdir = stemdir
+		end
+	end
+end
+
+memory_phase("layout")
+
+local staff3 = {}
+local extra3 = {}
+
+local x = 10
+local lasttime = 0
+
+-- staff3 entries of each note column in the order they were laid out on
+-- each staff, so that a later layout can link its notes back to them
+local columns = {}
+
+for staff, _ in pairs(staff1) do
+	staff3[staff] = {}
+	columns[staff] = {}
+end
+
+local staff3ify = function(timing, el, staff)
+	local xdiff
+	local tindex = point(timing)
+	if el.kind == "notecolumn" then
+		local glyphsize
+		if el.grace then
+			glyphsize = 24
+		else
+			glyphsize = 32
+		end
+		local rx = x
+		xdiff = 10
+		rx = rx + xdiff
+
+		local glyph
+		if el.length == 1 then
+			glyph = Glyph["noteheadWhole"]
+		elseif el.length == 2 then
+			glyph = Glyph["noteheadHalf"]
+		elseif el.length >= 4 then
+			glyph = Glyph["noteheadBlack"]
+		end
+
+		local w, h = glyph_extents(glyph, glyphsize)
+		local column = {heads={}}
+
+		local preoffset = 0
+
+		-- TODO: increment on each accidental to reduce overlap
+		for _, head in ipairs(el.heads) do
+			if #head.acc then
+				preoffset = 10
+			end
+		end
+
+		-- offset of stem if a head is drawn on opposite side of stem
+		local altoffset = 0
+		if timings[tindex].flipped then
+			altoffset = w - 1.2
+		end
+
+		local heightsum = 0
+		local lowheight
+		local highheight
+		for _, head in ipairs(el.heads) do
+			heightsum = heightsum + head.y
+			local ry = (em*head.y) / 2 + 2*em
+			if not lowheight then lowheight = ry end
+			if not highheight then highheight = ry end
+			if head.flip then
+				head.glyph = {kind="glyph", width=w, size=glyphsize, glyph=glyph, x=preoffset + rx, y=ry, time={start=head.time}}
+			else
+				head.glyph = {kind="glyph", width=w, size=glyphsize, glyph=glyph, x=preoffset + altoffset + rx, y=ry, time={start=head.time}}
+			end
+			table.insert(staff3[staff], head.glyph)
+			table.insert(column.heads, #staff3[staff])
+
+			if el.dot then
+				xdiff = xdiff + 5
+				table.insert(staff3[staff], {kind="circle", r=1.5, x=preoffset + altoffset + rx + w + 5, y=ry, time={start=head.time}})
+			end
+			if head.acc == "s" then
+				table.insert(staff3[staff], {kind="glyph", size=glyphsize, glyph=Glyph["accidentalSharp"], x=rx, y=ry, time={start=head.time}})
+			elseif head.acc == "f" then
+				table.insert(staff3[staff], {kind="glyph", size=glyphsize, glyph=Glyph["accidentalFlat"], x=rx, y=ry, time={start=head.time}})
+			elseif head.acc == "n" then
+				table.insert(staff3[staff], {kind="glyph", size=glyphsize, glyph=Glyph["accidentalNatural"], x=rx, y=ry, time={start=head.time}})
+			end
+
+			lowheight = math.min(lowheight, ry)
+			highheight = math.max(highheight, ry)
+
+			local stoptime
+			if el.time then stoptime = el.time + 1 else stoptime = nil end
+			-- TODO: only do this once per column
+			-- leger lines
+			if head.y <= -6 then
+				for j = -6, head.y, -2 do
+					table.insert(staff3[staff], {kind="line", t=1.2, x1=altoffset + preoffset + rx - .2*em, y1=(em * (j + 4)) / 2, x2=altoffset + preoffset + rx + w + .2*em, y2=(em * (j + 4)) / 2, time={start=el.time, stop=stoptime}})
+				end
+			end
+
+			if head.y >= 6 then
+				for j = 6, head.y, 2 do
+					table.insert(staff3[staff], {kind="line", t=1.2, x1=altoffset + preoffset + rx - .2*em, y1=(em * (j + 4)) / 2, x2=altoffset + preoffset + rx + w + .2*em, y2=(em * (j + 4)) / 2, time={start=el.time, stop=stoptime}})
+				end
+			end
+		end
+
+		if not el.stemdir and el.length > 1 then
+			if heightsum <= 0 then
+				el.stemdir = 1
+			else
+				el.stemdir = -1
+			end
+		end
+
+		-- stem
+		local stemstoptime
+		if el.stemdir then
+			if el.time then stemstoptime = el.time + .25 else stemstoptime = nil end
+			if el.stemdir == -1 then
+				-- stem up
+				-- advance width for bravura is 1.18 - .1 for stem width
+				el.stemx = w + rx - 1.08 + preoffset + altoffset
+				local stem = {kind="line", t=1, x1=el.stemx, y1=highheight - .168*em, x2=el.stemx, y2=lowheight -.168*em - el.stemlen*em, time={start=el.time, stop=stemstoptime}}
+				el.stem = stem
+				table.insert(staff3[staff], el.stem)
+				column.stem, column.y2 = #staff3[staff], stem.y2
+			else
+				el.stemx = rx + .5 + preoffset + altoffset
+				local stem = {kind="line", t=1, x1=el.stemx, y1=lowheight + .168*em, x2=el.stemx, y2=highheight + el.stemlen*em, time={start=el.time, stop=stemstoptime}}
+				el.stem = stem
+				table.insert(staff3[staff], stem)
+				column.stem, column.y2 = #staff3[staff], stem.y2
+			end
+		end
+
+		-- flag
+		if el.length == 8 and not el.beamgroup then
+			if el.stemdir == 1 then
+				local fx, fy = glyph_extents(Glyph["flag8thDown"], glyphsize)
+				table.insert(staff3[staff], {kind="glyph", glyph=Glyph["flag8thDown"], size=glyphsize, x=altoffset + preoffset + rx, y=highheight + 3.5*em, time={start=stemstoptime}})
+			else
+				-- TODO: move glyph extents to a precalculated table or something
+				local fx, fy = glyph_extents(Glyph["flag8thUp"], glyphsize)
+				table.insert(staff3[staff], {kind="glyph", glyph=Glyph["flag8thUp"], size=glyphsize, x=altoffset + el.stemx - .48, y=lowheight -.168*em - 3.5*em, time={start=stemstoptime}})
+				xdiff = xdiff + fx
+			end
+		end
+		xdiff = xdiff + 100 / el.length + 10
+		lasttime = el.time
+
+		column.stemx, column.stemdir = el.stemx, el.stemdir
+		table.insert(columns[staff], column)
+	elseif el.kind == "srest" then
+		xdiff = 0
+	elseif el.kind == "clef" then
+		table.insert(staff3[staff], {kind="glyph", glyph=el.class.glyph, size=32, x=x, y=el.class.yoff, time={start=timings[tindex].mintime, stop=timings[tindex].mintime + 1}})
+		xdiff =  30
+	elseif el.kind == "time" then
+		-- TODO: draw multidigit time signatures properly
+		table.insert(staff3[staff], {kind="glyph", glyph=numerals[el.num], size=32, x=x, y=em, time={start=timings[tindex].mintime, stop=timings[tindex].mintime + 1}})
+		table.insert(staff3[staff], {kind="glyph", glyph=numerals[el.denom], size=32, x=x, y=3*em, time={start=timings[tindex].mintime, stop=timings[tindex].mintime + 1}})
+		xdiff =  30
+	end
+
+	return xdiff
+end
+
+local rtimings = {}
+local snappoints = {}
+local curclef = {}
+
+-- x and the latest note time after each point, from which rtimings and
+-- snappoints are rebuilt when resuming
+local pointx = {}
+local pointmax = {}
+
+-- layout state before each barline
+local checkpoints = {}
+local checkpoint = function(i)
+	local c = {point=i, x=x, extra=#extra3, items={}, columns={}, clefs={}}
+	for staff, items in pairs(staff3) do
+		c.items[staff] = #items
+		c.columns[staff] = #columns[staff]
+	end
+	for staff, class in pairs(curclef) do
+		c.clefs[staff] = clefname(class)
+	end
+	table.insert(checkpoints, c)
+end
+
+local truncate = function(t, n)
+	for i = #t, n + 1, -1 do
+		t[i] = nil
+	end
+end
+
+local lastbarpoint
+for i, time in ipairs(points) do
+	if point(time) == lastbarline then
+		lastbarpoint = i
+	end
+end
+
+-- resume from the last checkpoint of the previous layout before the first
+-- change. nothing before it can depend on what changed, since items are
+-- laid out in time order.
+local start = 1
+if previous and previous.checkpoints then
+	local limit = #points + 1
+	if changed then
+		limit = 1
+		while limit <= #points and points[limit] < changed do
+			limit = limit + 1
+		end
+	end
+
+	-- the last barline is drawn differently
+	if lastbarpoint ~= previous.lastbarpoint then
+		limit = math.min(limit, lastbarpoint or 1, previous.lastbarpoint or 1)
+	end
+
+	local resume
+	for _, c in ipairs(previous.checkpoints) do
+		if c.point <= limit then
+			resume = c
+		end
+	end
+
+	if resume then
+		start = resume.point
+		x = resume.x
+		for staff, name in pairs(resume.clefs) do
+			curclef[staff] = Clef[name]
+		end
+
+		for staff, _ in pairs(staff1) do
+			staff3[staff] = previous.staff3[staff] or {}
+			truncate(staff3[staff], resume.items[staff] or 0)
+			columns[staff] = previous.columns[staff] or {}
+			truncate(columns[staff], resume.columns[staff] or 0)
+		end
+		extra3 = previous.extra3
+		truncate(extra3, resume.extra)
+
+		for _, c in ipairs(previous.checkpoints) do
+			if c.point < start then
+				table.insert(checkpoints, c)
+			end
+		end
+
+		for i = 1, start - 1 do
+			pointx[i] = previous.pointx[i]
+			pointmax[i] = previous.pointmax[i]
+			rtimings[pointmax[i]] = pointx[i]
+			if pointmax[i] ~= 0 then
+				table.insert(snappoints, pointmax[i])
+			end
+		end
+
+		-- link the notes before the checkpoint to what was laid out for them,
+		-- which beams and ties below need
+		local seen = {}
+		for i = 1, start - 1 do
+			for staff, vals in pairs(timings[point(points[i])].staffs) do
+				for _, list in ipairs({vals.pre, vals.on}) do
+					for _, el in ipairs(list) do
+						seen[staff] = (seen[staff] or 0) + 1
+						local column = assert(columns[staff][seen[staff]])
+						el.stemx = column.stemx
+						el.stemdir = column.stemdir
+						for j, head in ipairs(el.heads) do
+							head.glyph = staff3[staff][column.heads[j]]
+						end
+						if column.stem then
+							el.stem = staff3[staff][column.stem]
+							-- undo any adjustment made for a beam
+							el.stem.y2 = column.y2
+						end
+					end
+				end
+			end
+		end
+	end
+end
+
+for i = start, #points do
+	local time = points[i]
+	local tindex = point(time)
+	local todraw = timings[tindex].staffs
+
+	if timings[tindex].barline then
+		checkpoint(i)
+	end
+
+	-- clef
+	local xdiff = 0
+	for staff, vals in pairs(todraw) do
+		if vals.clef and (vals.clef.class ~= curclef[staff]) then
+			local diff = staff3ify(time, vals.clef, staff)
+			if diff > xdiff then xdiff = diff end
+			curclef[staff] = vals.clef.class
+		end
+	end
+
+	x = x + xdiff
+	xdiff = 0
+
+	-- time signature
+	local xdiff = 0
+	for staff, vals in pairs(todraw) do
+		if vals.timesig then
+			local diff = staff3ify(time, vals.timesig, staff)
+			if diff > xdiff then xdiff = diff end
+		end
+	end
+
+	x = x + xdiff
+	xdiff = 0
+
+	if timings[tindex].barline then
+		local time = timings[tindex].mintime or 0
+		if tindex == lastbarline then
+			table.insert(extra3, {kind='barline', x=x+25, last=true, time={start=time - 1, stop=time}})
+		else
+			table.insert(extra3, {kind='barline', x=x+25, time={start=time - 1, stop=time}})
+		end
+		x = x + 10
+	end
+
+	-- prebeat
+	for staff, vals in pairs(todraw) do
+		if #vals.pre == 0 then goto nextstaff end
+		for _, el in ipairs(vals.pre) do
+			local diff = staff3ify(time, el, staff)
+			if el.beamref then staff3ify(time, el.beamref, staff) end
+			x = x + diff
+		end
+		::nextstaff::
+	end
+	xdiff = 0
+
+	local maxtime = 0
+	-- on beat
+	for staff, vals in pairs(todraw) do
+		if #vals.on == 0 then goto nextstaff end
+		local diff
+		for _, el in ipairs(vals.on) do
+			-- HACK: don't hardcode staff name
+			if staff == "low" and el.time and el.time > maxtime then maxtime = el.time end
+			diff = staff3ify(time, el, staff)
+			if el.beamref then staff3ify(time, el.beamref, staff) end
+		end
+		if xdiff < diff then xdiff = diff end
+		::nextstaff::
+	end
+
+	x = x + xdiff
+	pointx[i] = x
+	pointmax[i] = maxtime
+	rtimings[maxtime] = x
+	if maxtime ~= 0 then
+		table.insert(snappoints, maxtime)
+	end
+end
+checkpoint(#points + 1)
+
+-- calculate extents
+local extents = {}
+
+for _, staff in pairs(stafforder) do
+	local items = staff3[staff]
+	extents[staff] = {xmin=0, ymin=0, xmax=0, ymax=0}
+	for i, d in ipairs(items) do
+		if d.kind == "glyph" then
+			local w, h = glyph_extents(d.glyph, 32)
+			if d.x - w < extents[staff].xmin then
+				extents[staff].xmin = d.x - w
+			elseif d.x + w > extents[staff].xmax then
+				extents[staff].xmax = d.x + w
+			end
+
+			if d.y - h < extents[staff].ymin then
+				extents[staff].ymin = d.y - h
+			elseif d.y + h > extents[staff].ymax then
+				extents[staff].ymax = d.y + h
+			end
+		elseif d.kind == "line" then
+			if d.x1 < extents[staff].xmin then
+				extents[staff].xmin = d.x1
+			elseif d.x1 > extents[staff].xmax then
+				extents[staff].xmax = d.x1
+			end
+
+			if d.x2 < extents[staff].xmin then
+				extents[staff].xmin = d.x2
+			elseif d.x2 > extents[staff].xmax then
+				extents[staff].xmax = d.x2
+			end
+
+			if d.y1 < extents[staff].ymin then
+				extents[staff].ymin = d.y1
+			elseif d.y1 > extents[staff].ymax then
+				extents[staff].ymax = d.y1
+			end
+
+			if d.y2 < extents[staff].ymin then
+				extents[staff].ymin = d.y2
+			elseif d.y2 > extents[staff].ymax then
+				extents[staff].ymax = d.y2
+			end
+		elseif d.kind == "quad" then
+			if d.x1 < extents[staff].xmin then
+				extents[staff].xmin = d.x1
+			elseif d.x1 > extents[staff].xmax then
+				extents[staff].xmax = d.x1
+			end
+
+			if d.x2 < extents[staff].xmin then
+				extents[staff].xmin = d.x2
+			elseif d.x2 > extents[staff].xmax then
+				extents[staff].xmax = d.x2
+			end
+
+			if d.y1 < extents[staff].ymin then
+				extents[staff].ymin = d.y1
+			elseif d.y1 > extents[staff].ymax then
+				extents[staff].ymax = d.y1
+			end
+
+			if d.y2 < extents[staff].ymin then
+				extents[staff].ymin = d.y2
+			elseif d.y2 > extents[staff].ymax then
+				extents[staff].ymax = d.y2
+			end
+
+			if d.x3 < extents[staff].xmin then
+				extents[staff].xmin = d.x3
+			elseif d.x3 > extents[staff].xmax then
+				extents[staff].xmax = d.x3
+			end
+
+			if d.x4 < extents[staff].xmin then
+				extents[staff].xmin = d.x4
+			elseif d.x4 > extents[staff].xmax then
+				extents[staff].xmax = d.x4
+			end
+
+			if d.y3 < extents[staff].ymin then
+				extents[staff].ymin = d.y3
+			elseif d.y3 > extents[staff].ymax then
+				extents[staff].ymax = d.y3
+			end
+
+			if d.y4 < extents[staff].ymin then
+				extents[staff].ymin = d.y4
+			elseif d.y4 > extents[staff].ymax then
+				extents[staff].ymax = d.y4
+			end
+		end
+	end
+end
+
+local xmax = 0
+local yoff = 0
+local firstymin, lastymin
+local xmin = 0
+for i, staff in pairs(stafforder) do
+	local extent = extents[staff]
+	if xmin > extent.xmin then
+		xmin = extent.xmin
+	end
+
+	if xmax < extent.xmax then
+		xmax = extent.xmax
+	end
+
+	if i == 1 then
+		firstymin = yoff + extent.ymin
+	end
+
+	if i == #stafforder then
+		lastymin = yoff - extent.ymin
+	end
+
+	extent.yoff = yoff
+	yoff = yoff + extent.ymax - extent.ymin
+end
+
+for _, tie in pairs(ties) do
+	local yoff = extents[tie.staff].yoff - extents[tie.staff].ymin
+	table.insert(extra3, {kind="curve", x0=tie.start.glyph.x + tie.start.glyph.width + 10, y0=tie.start.glyph.y + yoff, x2=tie.stop.glyph.x + 10, y2=tie.stop.glyph.y + yoff, time={start=tie.start.glyph.time.start, stop=tie.stop.glyph.time.start}})
+end
+
+-- draw beam (and adjust stems) after all previous notes already have set values
+for _, notes in ipairs(beams) do
+	local beamheight, beamspace
+	if notes.grace then
+		beamheight = 3
+		beamspace = 5
+	else
+		beamheight = 5
+		beamspace = 7
+	end
+	local x0 = notes[1].note.stemx + .5
+	local y0 = notes[1].note.stem.y2 + extents[notes[1].note.staff].yoff - extents[notes[1].note.staff].ymin
+	local y0s = notes[1].note.stem.y2
+	local yn = notes[#notes].note.stem.y2 + extents[notes[#notes].note.staff].yoff - extents[notes[#notes].note.staff].ymin
+	local m = (yn - y0) / (notes[#notes].note.stemx + .5 - x0)
+
+	-- THIS IS A HACK: replace with more generic mechanism that detects overlap
+	-- this only accounts for stems pointing do
+	local stemextension = 0
+	if notes[1].count == 3 and notes[1].note.stemdir == -1 then
+		stemextension = -10
+	end
+
+	if notes.cross then
+		if notes[1].note.stemdir == -1 then
+			notes[1].note.stem.y2 = notes[1].note.stem.y2 - beamspace * (notes.maxbeams - 1) + beamheight
+		end
+		if notes[1].note.stemdir == 1 and notes[2] and notes[2].note.stemdir == -1 then
+			notes[1].note.stem.y2 = notes[1].note.stem.y2 + beamspace * notes.maxbeams
+		end
+	end
+
+	if notes[1].note.stemdir == 1 then
+		notes[1].note.stem.y2 = y0s + 7*(notes.maxbeams - 2) + beamheight + stemextension
+	end
+
+	for i, entry in ipairs(notes) do
+		if i == 1 then goto continue end
+		local note = notes[i].note
+		local n = entry.count
+		local x1 = notes[i-1].note.stemx + .5
+		local prevymin = extents[notes[i-1].note.staff].ymin
+		local x2 = note.stemx + .5
+		local extent = extents[note.staff]
+
+		-- change layout parameters depending on stem up or stem down
+		local first, last, inc
+		if entry.note.stemdir == 1 then
+			first = beamspace*(notes.maxbeams - 2)
+			last = beamspace*(notes.maxbeams - n - 1)
+			if extents[entry.note.staff].yoff < extents[notes[1].note.staff].yoff then
+				entry.note.stem.y2 = y0 + m*(x2 - x0) + 7*(notes.maxbeams - 2) + beamheight + extents[entry.note.staff].ymin - extents[entry.note.staff].yoff + stemextension
+			else
+				entry.note.stem.y2 = y0s + m*(x2 - x0) + 7*(notes.maxbeams - 2) + beamheight + stemextension
+			end
+			inc = -beamspace
+		else
+			if extents[entry.note.staff].yoff > extents[notes[1].note.staff].yoff then
+				entry.note.stem.y2 = y0 + m*(x2 - x0) + beamheight - extents[entry.note.staff].yoff + extents[entry.note.staff].ymin + stemextension
+			else
+				entry.note.stem.y2 = y0s + m*(x2 - x0) + stemextension
+			end
+			first = 0
+			last = beamspace*(n-1)
+			inc = beamspace
+		end
+
+		-- draw beams segment by segment
+		for yoff=first, last, inc do
+			local starttime, stoptime
+			if note.time then stoptime = note.time + .25 else stoptime = nil end
+			if note.time then starttime = notes[i-1].note.time + .25 else starttime = nil end
+			if entry.note.stemdir ~= 1 and notes.cross then
+				table.insert(extra3, {kind="beamseg", x1=x1 - 0.5 - extent.xmin, x2=x2 - extent.xmin, y1=y0 + m*(x1 - x0) + yoff + stemextension, y2=y0 + m*(x2 - x0) + yoff + stemextension, h=beamheight, time={start=starttime, stop=stoptime}})
+			else
+				table.insert(extra3, {kind="beamseg", x1=x1 - 0.5 - extent.xmin, x2=x2 - extent.xmin, y1=y0 + m*(x1 - x0) + yoff + stemextension, y2=y0 + m*(x2 - x0) + yoff + stemextension, h=beamheight, time={start=starttime, stop=stoptime}})
+			end
+		end
+		::continue::
+	end
+end
+
+for staff, item in ipairs(extra3) do
+	if item.kind == 'barline' then
+		if item.x < xmin then
+			xmin = item.x
+		elseif item.x > xmax then
+			if item.last then
+				xmax = item.x + 7
+			else
+				xmax = item.x
+			end
+		end
+	end
+end
+
+return {
+	em=em,
+	stafforder=stafforder,
+	staff3=staff3,
+	extra3=extra3,
+	extents=extents,
+	rtimings=rtimings,
+	snappoints=snappoints,
+	xmin=xmin,
+	xmax=xmax,
+	firstymin=firstymin,
+	lastymin=lastymin,
+	height=yoff,
+	measures=measures,
+	columns=columns,
+	checkpoints=checkpoints,
+	pointx=pointx,
+	pointmax=pointmax,
+	lastbarpoint=lastbarpoint,
+}
@@ -0,0 +1,189 @@
+/*
+* imbench.c
+* time imath multiplication and allocation on this host and print tuned
+* settings as a header for lqmath
+*/
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "imath.h"
+#include "imrat.h"
+
+// minimum time spent measuring each configuration
+#define MINTIME 0.02
+#define RUNS 3
+
+static const mp_size sizes[] = {8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static const mp_size precisions[] = {2, 4, 8, 16, 32};
+#define NPRECISIONS (sizeof(precisions) / sizeof(precisions[0]))
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+randomize(mp_int z, mp_size ndigits)
+{
+	int len = ndigits * sizeof(mp_digit);
+	unsigned char *buf = malloc(len);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < len; i++)
+		buf[i] = rand() & 0xFF;
+	// make sure the operand really has ndigits digits
+	buf[0] |= 0x80;
+
+	if (mp_int_read_unsigned(z, buf, len) != MP_OK) {
+		fprintf(stderr, "failed to set operand\n");
+		exit(1);
+	}
+
+	free(buf);
+}
+
+// seconds per call of mp_int_mul(a, b, c), or mp_int_sqr(a, c) if b is NULL,
+// taking the best of a few runs to reduce noise
+static double
+timemul(mp_int a, mp_int b, mp_int c)
+{
+	double best = 0;
+	for (int run = 0; run < RUNS; run++) {
+		long n = 0;
+		double start = now(), elapsed;
+		do {
+			for (int i = 0; i < 16; i++) {
+				if (b)
+					mp_int_mul(a, b, c);
+				else
+					mp_int_sqr(a, c);
+			}
+			n += 16;
+			elapsed = now() - start;
+		} while (elapsed < MINTIME);
+
+		if (run == 0 || elapsed / n < best)
+			best = elapsed / n;
+	}
+
+	return best;
+}
+
+// find the smallest operand size from which a recursive multiply at the
+// top level is faster than schoolbook multiplication for every larger
+// size measured
+static mp_size
+crossover(bool square)
+{
+	mpz_t a, b, c;
+	bool faster[NSIZES];
+
+	mp_int_init(&a);
+	mp_int_init(&b);
+	mp_int_init(&c);
+
+	for (size_t i = 0; i < NSIZES; i++) {
+		randomize(&a, sizes[i]);
+		randomize(&b, sizes[i]);
+
+		mp_int_multiply_threshold(UINT_MAX);
+		double school = timemul(&a, square ? NULL : &b, &c);
+
+		// s_ksqr only recurses on operands strictly larger than the threshold
+		if (square && sizes[i] > sizeof(mp_word))
+			mp_int_multiply_threshold(sizes[i] - 1);
+		else
+			mp_int_multiply_threshold(sizes[i]);
+		double kara = timemul(&a, square ? NULL : &b, &c);
+
+		faster[i] = kara < school;
+		fprintf(stderr, "%s %4u digits: schoolbook %10.0f ns, karatsuba %10.0f ns\n",
+				square ? "sqr" : "mul", sizes[i], school * 1e9, kara * 1e9);
+	}
+
+	mp_int_clear(&a);
+	mp_int_clear(&b);
+	mp_int_clear(&c);
+
+	mp_size thresh = UINT_MAX;
+	for (int i = NSIZES - 1; i >= 0 && faster[i]; i--)
+		thresh = sizes[i];
+
+	return thresh;
+}
+
+// time a rational workload similar to smallpond's placement, where
+// every operation produces a fresh value
+static double
+timeprecision(mp_size prec)
+{
+	mpq_t acc, incr, tmp;
+	long n = 0;
+	double start, elapsed;
+
+	mp_int_default_precision(prec);
+	mp_rat_init(&acc);
+	mp_rat_init(&incr);
+
+	start = now();
+	do {
+		mp_rat_zero(&acc);
+		for (int i = 0; i < 256; i++) {
+			mp_rat_set_value(&incr, 3, (i % 7 + 1) * (i % 5 + 2) * 8);
+			mp_rat_init(&tmp);
+			mp_rat_add(&acc, &incr, &tmp);
+			mp_rat_copy(&tmp, &acc);
+			mp_rat_clear(&tmp);
+		}
+		n += 256;
+		elapsed = now() - start;
+	} while (elapsed < 10 * MINTIME);
+
+	mp_rat_clear(&acc);
+	mp_rat_clear(&incr);
+
+	fprintf(stderr, "precision %2u: %6.0f ns\n", prec, elapsed / n * 1e9);
+
+	return elapsed / n;
+}
+
+int
+main(void)
+{
+	srand(1);
+
+	mp_size mul = crossover(false);
+	mp_size sqr = crossover(true);
+
+	mp_size prec = precisions[0];
+	double best = timeprecision(prec);
+	for (size_t i = 1; i < NPRECISIONS; i++) {
+		double t = timeprecision(precisions[i]);
+		if (t < best) {
+			best = t;
+			prec = precisions[i];
+		}
+	}
+
+	printf("/* generated by imbench, do not edit */\n");
+	// one threshold is shared between multiplication and squaring, and
+	// multiplication is by far the more common operation for rationals
+	// UINT_MAX disables recursive multiplication altogether
+	printf("#define IMATH_MULTIPLY_THRESHOLD %uu\n", mul);
+	printf("/* squaring crossover: %u digits */\n", sqr);
+	printf("#define IMATH_DEFAULT_PRECISION %u\n", prec);
+
+	return 0;
+}
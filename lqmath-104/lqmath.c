@@ -15,6 +15,10 @@
 #include "lauxlib.h"
 #include "mycompat.h"
 
+#ifdef IMTUNE
+#include "imtune.h"
+#endif
+
 #define MYNAME		"qmath"
 #define MYVERSION	MYNAME " library for " LUA_VERSION " / Jul 2018"
 #define MYTYPE		MYNAME " rational"
@@ -262,6 +266,117 @@ static int Lpow(lua_State *L)			/** pow(x,y) */
  return report(L,mp_rat_expt(a,b,c),1);
 }
 
+static int Pdoto(lua_State *L, mp_result (*f)(mp_rat a, mp_rat b, mp_rat c))
+{
+ mp_rat a=luaL_checkudata(L,1,MYTYPE);
+ mp_rat b=Pget(L,2);
+ lua_pushvalue(L,1);
+ return report(L,f(a,b,a),1);
+}
+
+static int Laddto(lua_State *L)			/** addto(x,y) */
+{
+ return Pdoto(L,mp_rat_add);
+}
+
+static int Lsubfrom(lua_State *L)		/** subfrom(x,y) */
+{
+ return Pdoto(L,mp_rat_sub);
+}
+
+static int Lmulby(lua_State *L)			/** mulby(x,y) */
+{
+ return Pdoto(L,mp_rat_mul);
+}
+
+static int Ldivby(lua_State *L)			/** divby(x,y) */
+{
+ return Pdoto(L,mp_rat_div);
+}
+
+static int Lset(lua_State *L)			/** set(x,y) */
+{
+ mp_rat a=luaL_checkudata(L,1,MYTYPE);
+ mp_rat b=Pget(L,2);
+ lua_pushvalue(L,1);
+ return report(L,mp_rat_copy(b,a),1);
+}
+
+typedef struct { mp_rat x; int i; } Pitem;
+
+static mp_rat Pelem(lua_State *L, int i)
+{
+ mp_rat x=luaL_testudata(L,-1,MYTYPE);
+ if (x==NULL) luaL_error(L,"(qmath) rational expected at index %d",i);
+ return x;
+}
+
+static void Pmergesort(Pitem *a, Pitem *w, int n)
+{
+ int m=n/2,i,j,k;
+ if (n<2) return;
+ Pmergesort(a,w,m);
+ Pmergesort(a+m,w,n-m);
+ if (mp_rat_compare(a[m-1].x,a[m].x)<=0) return;
+ memcpy(w,a,m*sizeof(*a));
+ for (i=0,j=m,k=0; i<m && j<n; k++)
+  a[k] = (mp_rat_compare(a[j].x,w[i].x)<0) ? a[j++] : w[i++];
+ while (i<m) a[k++]=w[i++];
+}
+
+static int Lsort(lua_State *L)			/** sort(t) */
+{
+ int n,i;
+ Pitem *a;
+ luaL_checktype(L,1,LUA_TTABLE);
+ n=lua_rawlen(L,1);
+ a=lua_newuserdata(L,(n+n/2+1)*sizeof(*a));
+ lua_createtable(L,n,0);
+ for (i=1; i<=n; i++)
+ {
+  lua_rawgeti(L,1,i);
+  a[i-1].x=Pelem(L,i);
+  a[i-1].i=i;
+  lua_rawseti(L,-2,i);
+ }
+ Pmergesort(a,a+n,n);
+ for (i=1; i<=n; i++)
+ {
+  lua_rawgeti(L,-1,a[i-1].i);
+  lua_rawseti(L,1,i);
+ }
+ lua_settop(L,1);
+ return 1;
+}
+
+static int Lunique(lua_State *L)		/** unique(t) */
+{
+ int n,i,j=0;
+ mp_rat last=NULL;
+ luaL_checktype(L,1,LUA_TTABLE);
+ n=lua_rawlen(L,1);
+ for (i=1; i<=n; i++)
+ {
+  mp_rat x;
+  lua_rawgeti(L,1,i);
+  x=Pelem(L,i);
+  if (last==NULL || mp_rat_compare(x,last)!=0)
+  {
+   lua_pushvalue(L,-1);
+   lua_rawseti(L,1,++j);
+   last=x;
+  }
+  lua_pop(L,1);
+ }
+ for (i=j+1; i<=n; i++)
+ {
+  lua_pushnil(L);
+  lua_rawseti(L,1,i);
+ }
+ lua_pushinteger(L,j);
+ return 1;
+}
+
 static int Lgc(lua_State *L)
 {
  mp_rat x=Pget(L,1);
@@ -286,28 +401,41 @@ static const luaL_Reg R[] =
 	{ "__unm",	Lneg	},		/** __unm(x) */
 	{ "abs",	Labs	},
 	{ "add",	Ladd	},
+	{ "addto",	Laddto	},
 	{ "compare",	Lcompare},
 	{ "denom",	Ldenom	},
 	{ "div",	Ldiv	},
+	{ "divby",	Ldivby	},
 	{ "int",	Lint	},
 	{ "inv",	Linv	},
 	{ "isinteger",	Lisinteger},
 	{ "iszero",	Liszero	},
 	{ "mul",	Lmul	},
+	{ "mulby",	Lmulby	},
 	{ "neg",	Lneg	},
 	{ "new",	Lnew	},
 	{ "numer",	Lnumer	},
 	{ "pow",	Lpow	},
+	{ "set",	Lset	},
 	{ "sign",	Lsign	},
+	{ "sort",	Lsort	},
 	{ "sub",	Lsub	},
+	{ "subfrom",	Lsubfrom},
 	{ "todecimal",	Ltodecimal},
 	{ "tonumber",	Ltonumber},
 	{ "tostring",	Ltostring},
+	{ "unique",	Lunique	},
 	{ NULL,		NULL	}
 };
 
 LUALIB_API int luaopen_qmath(lua_State *L)
 {
+#ifdef IMATH_MULTIPLY_THRESHOLD
+ mp_int_multiply_threshold(IMATH_MULTIPLY_THRESHOLD);
+#endif
+#ifdef IMATH_DEFAULT_PRECISION
+ mp_int_default_precision(IMATH_DEFAULT_PRECISION);
+#endif
  luaL_newmetatable(L,MYTYPE);
  luaL_setfuncs(L,R,0);
  lua_pushliteral(L,"version");			/** version */
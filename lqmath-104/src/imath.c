@@ -210,12 +210,17 @@ void mp_int_multiply_threshold(mp_size thresh) {
   multiply_threshold = thresh;
 }
 
+/* Called with the change in bytes of digit storage, if set */
+static void (*alloc_hook)(long delta);
+
+void mp_int_alloc_hook(void (*hook)(long delta)) { alloc_hook = hook; }
+
 /* Allocate a buffer of (at least) num digits, or return
    NULL if that couldn't be done.  */
 static mp_digit *s_alloc(mp_size num);
 
-/* Release a buffer of digits allocated by s_alloc(). */
-static void s_free(void *ptr);
+/* Release a buffer of num digits allocated by s_alloc(). */
+static void s_free(void *ptr, mp_size num);
 
 /* Insure that z has at least min digits allocated, resizing if
    necessary.  Returns true if successful, false if out of memory. */
@@ -462,7 +467,7 @@ void mp_int_clear(mp_int z) {
   if (z == NULL) return;
 
   if (MP_DIGITS(z) != NULL) {
-    if (MP_DIGITS(z) != &(z->single)) s_free(MP_DIGITS(z));
+    if (MP_DIGITS(z) != &(z->single)) s_free(MP_DIGITS(z), MP_ALLOC(z));
 
     z->digits = NULL;
   }
@@ -702,7 +707,7 @@ mp_result mp_int_mul(mp_int a, mp_int b, mp_int c) {
      using, and fix up its fields to reflect that.
    */
   if (out != MP_DIGITS(c)) {
-    if ((void *)MP_DIGITS(c) != (void *)c) s_free(MP_DIGITS(c));
+    if ((void *)MP_DIGITS(c) != (void *)c) s_free(MP_DIGITS(c), MP_ALLOC(c));
     c->digits = out;
     c->alloc = p;
   }
@@ -761,7 +766,7 @@ mp_result mp_int_sqr(mp_int a, mp_int c) {
      reflect the new digit array it's using
    */
   if (out != MP_DIGITS(c)) {
-    if ((void *)MP_DIGITS(c) != (void *)c) s_free(MP_DIGITS(c));
+    if ((void *)MP_DIGITS(c) != (void *)c) s_free(MP_DIGITS(c), MP_ALLOC(c));
     c->digits = out;
     c->alloc = p;
   }
@@ -1692,6 +1697,7 @@ static const mp_digit fill = (mp_digit)0xdeadbeefabad1dea;
 static mp_digit *s_alloc(mp_size num) {
   mp_digit *out = malloc(num * sizeof(mp_digit));
   assert(out != NULL);
+  if (alloc_hook != NULL) alloc_hook((long)(num * sizeof(mp_digit)));
 
 #if DEBUG
   for (mp_size ix = 0; ix < num; ++ix) out[ix] = fill;
@@ -1709,12 +1715,17 @@ static mp_digit *s_realloc(mp_digit *old, mp_size osize, mp_size nsize) {
 #else
   mp_digit *new = realloc(old, nsize * sizeof(mp_digit));
   assert(new != NULL);
+  if (alloc_hook != NULL)
+    alloc_hook(((long)nsize - (long)osize) * (long)sizeof(mp_digit));
 #endif
 
   return new;
 }
 
-static void s_free(void *ptr) { free(ptr); }
+static void s_free(void *ptr, mp_size num) {
+  if (alloc_hook != NULL) alloc_hook(-(long)(num * sizeof(mp_digit)));
+  free(ptr);
+}
 
 static bool s_pad(mp_int z, mp_size min) {
   if (MP_ALLOC(z) < min) {
@@ -1939,7 +1950,7 @@ static int s_kmul(mp_digit *da, mp_digit *db, mp_digit *dc, mp_size size_a,
         s_uadd(t2, dc + 2 * bot_size, dc + 2 * bot_size, buf_size, buf_size);
     assert(carry == 0);
 
-    s_free(t1); /* note t2 and t3 are just internal pointers to t1 */
+    s_free(t1, 4 * buf_size); /* note t2 and t3 are just internal pointers to t1 */
   } else {
     s_umul(da, db, dc, size_a, size_b);
   }
@@ -2011,7 +2022,7 @@ static int s_ksqr(mp_digit *da, mp_digit *dc, mp_size size_a) {
         s_uadd(t2, dc + 2 * bot_size, dc + 2 * bot_size, buf_size, buf_size);
     assert(carry == 0);
 
-    s_free(t1); /* note that t2 and t2 are internal pointers only */
+    s_free(t1, 4 * buf_size); /* note that t2 and t2 are internal pointers only */
 
   } else {
     s_usqr(da, dc, size_a);
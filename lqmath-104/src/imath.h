@@ -98,6 +98,11 @@ void mp_int_default_precision(mp_size ndigits);
     Requires `ndigits >= sizeof(mp_word)`. */
 void mp_int_multiply_threshold(mp_size ndigits);
 
+/** Sets a function to be called with the number of bytes of digit storage
+    allocated (positive) or released (negative) each time that changes, for
+    accounting. `NULL`, the default, turns this off. */
+void mp_int_alloc_hook(void (*hook)(long delta));
+
 /** A sign indicating a (strictly) negative value. */
 extern const mp_sign MP_NEG;
 
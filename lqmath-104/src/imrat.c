@@ -405,6 +405,18 @@ int mp_rat_compare_unsigned(mp_rat a, mp_rat b) {
     return mp_int_compare_unsigned(MP_NUMER_P(a), MP_NUMER_P(b));
   }
 
+  /* If every term fits in a single digit, the cross products fit in a word
+     and can be compared directly without allocating temporaries. */
+  else if (MP_USED(MP_NUMER_P(a)) == 1 && MP_USED(MP_DENOM_P(a)) == 1 &&
+           MP_USED(MP_NUMER_P(b)) == 1 && MP_USED(MP_DENOM_P(b)) == 1) {
+    mp_word t0 = (mp_word)MP_DIGITS(MP_NUMER_P(a))[0] *
+                 MP_DIGITS(MP_DENOM_P(b))[0];
+    mp_word t1 = (mp_word)MP_DIGITS(MP_NUMER_P(b))[0] *
+                 MP_DIGITS(MP_DENOM_P(a))[0];
+
+    return (t0 > t1) - (t0 < t1);
+  }
+
   else {
     mpz_t temp[2];
     mp_result res;
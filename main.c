@@ -1,6 +1,14 @@
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -22,12 +30,99 @@
 #define FRAMERATE 60
 
 int luaopen_qmath(lua_State *L);
+int parse_score(lua_State *L);
+int parse_measures(lua_State *L);
+uint64_t cache_hash(uint64_t h, const void *data, size_t len);
+uint64_t cache_hashfile(uint64_t h, const char *path);
+int cache_load(lua_State *L);
+int cache_save(lua_State *L);
+int watch(lua_State *L, int framerate);
+int batch(lua_State *L, const char *manifest, int workers, long first, long last);
+int items_new(lua_State *L);
+void items_open(lua_State *L);
+void timing_enable(const char *path);
+double timing_now(void);
+void timing_frame(long n);
+void timing_stage(const char *stage, double start);
+void timing_phase(const char *phase, double start);
+void timing_count(const char *counter, double n);
+void timing_report(void);
+void profile_start(lua_State *L);
+void profile_enter(void);
+void profile_leave(void);
+void profile_report(const char *path);
+void memory_enable(void);
+void *memory_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+void memory_digits(long delta);
+void memory_phase(const char *phase);
+int memory_lphase(lua_State *L);
+unsigned long memory_allocs(void);
+void memory_report(void);
+void mp_int_alloc_hook(void (*hook)(long delta));
 
 cairo_t *cr;
 FT_Face face;
 cairo_font_face_t *cface;
 cairo_surface_t *surface;
 
+char *score = "";
+size_t scorelen;
+
+// size of the frames, which --size can change
+int width = WIDTH;
+int height = HEIGHT;
+
+// the files read and written, which the command line can change, so that
+// renders of different scores can run side by side in one directory.
+// layout.lua is found next to the script, and the layout cache next to
+// the score.
+const char *scorepath = "score.sp";
+const char *scriptpath = "smallpond.lua";
+const char *layoutpath;
+const char *cachepath;
+// whether the layout is written back to the cache, which a batch only lets
+// the first job of each score do
+bool savecache = true;
+const char *fontpath = "/usr/share/fonts/OTF/Bravura.otf";
+const char *audiopath = "file:intermezzo.webm";
+// the video, or the image with --frame
+const char *outpath;
+// the muxer to write the video with, or NULL to go by outpath
+const char *outformat;
+
+// render without encoding, and print a checksum of every frame
+static bool nullout, checksums;
+
+// threads for each encoder, or 0 to leave it to libav, which gives each one
+// a thread per core. a batch sets it so its encoders share the cores.
+int encthreads;
+
+// primitives drawn since they were last reported, so that the cost of a
+// frame can be related to how much is in it
+static struct {
+	unsigned long glyph, line, circle, quad, curve, extents;
+} drawn;
+// calls from lua into the C functions for drawing, which items.c counts too
+unsigned long luacalls;
+
+// how lua's collector runs, as set on the command line. by default it is
+// left as lua sets it up, running whenever allocation drives it, which can
+// be in the middle of a frame. with step, it is stopped while frames are
+// drawn and does that many kilobytes of work after each one instead.
+static struct {
+	// LUA_GCGEN or LUA_GCINC, or 0 for lua's default. before lua 5.4 the
+	// collector is always incremental, and this stays 0.
+	int mode;
+	// the incremental collector's pause and step multiplier in percent,
+	// or 0 to keep lua's
+	int pause;
+	int stepmul;
+	int step;
+	// stop the collector while the script runs, which is mostly layout,
+	// and collect everything it left behind after
+	bool stoplayout;
+} gc;
+
 // return control points for cubic bezier curve corresponding to
 // bezier curve that t of the way through the bezier curve produced
 // by the control points.
@@ -68,6 +163,8 @@ draw_curve(lua_State *L)
 	double x2 = lua_tonumber(L, -2);
 	double y2 = lua_tonumber(L, -1);
 
+	luacalls++;
+	drawn.curve++;
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
 
 	double q0x, q0y, r0x, r0y, bx, by;
@@ -83,6 +180,33 @@ draw_curve(lua_State *L)
 	return 0;
 }
 
+// draw in the coordinates of a staff, scaled by scale and then offset by
+// (x, y) on the frame, until the matching poptransform()
+void
+pushtransform(double scale, double x, double y)
+{
+	cairo_save(cr);
+	cairo_translate(cr, x, y);
+	cairo_scale(cr, scale, scale);
+}
+
+void
+poptransform(void)
+{
+	cairo_restore(cr);
+}
+
+// the primitives are also called directly by the item store in items.c
+void
+drawcircle(double r, double x, double y)
+{
+	drawn.circle++;
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+
+	cairo_arc(cr, x, y, r, 0, 2*M_PI);
+	cairo_fill(cr);
+}
+
 int
 draw_circle(lua_State *L)
 {
@@ -90,14 +214,24 @@ draw_circle(lua_State *L)
 	double x = lua_tonumber(L, -2);
 	double y = lua_tonumber(L, -1);
 
-	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-
-	cairo_arc(cr, x, y, r, 0, 2*M_PI);
-	cairo_fill(cr);
+	luacalls++;
+	drawcircle(r, x, y);
 
 	return 0;
 }
 
+void
+drawline(double t, double x1, double y1, double x2, double y2)
+{
+	drawn.line++;
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+
+	cairo_move_to(cr, x1, y1);
+	cairo_line_to(cr, x2, y2);
+	cairo_set_line_width(cr, t);
+	cairo_stroke(cr);
+}
+
 int
 draw_line(lua_State *L)
 {
@@ -107,14 +241,23 @@ draw_line(lua_State *L)
 	double x2 = lua_tonumber(L, -2);
 	double y2 = lua_tonumber(L, -1);
 
+	luacalls++;
+	drawline(t, x1, y1, x2, y2);
+
+	return 0;
+}
+
+void
+drawquad(double x1, double y1, double x2, double y2, double x3, double y3, double x4, double y4)
+{
+	drawn.quad++;
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
 
 	cairo_move_to(cr, x1, y1);
 	cairo_line_to(cr, x2, y2);
-	cairo_set_line_width(cr, t);
-	cairo_stroke(cr);
-
-	return 0;
+	cairo_line_to(cr, x3, y3);
+	cairo_line_to(cr, x4, y4);
+	cairo_fill(cr);
 }
 
 int
@@ -129,25 +272,16 @@ draw_quad(lua_State *L)
 	double x4 = lua_tonumber(L, -2);
 	double y4 = lua_tonumber(L, -1);
 
-	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-
-	cairo_move_to(cr, x1, y1);
-	cairo_line_to(cr, x2, y2);
-	cairo_line_to(cr, x3, y3);
-	cairo_line_to(cr, x4, y4);
-	cairo_fill(cr);
+	luacalls++;
+	drawquad(x1, y1, x2, y2, x3, y3, x4, y4);
 
 	return 0;
 }
 
-int
-draw_glyph(lua_State *L)
+void
+drawglyph(double size, unsigned int val, double x, double y)
 {
-	double size = lua_tonumber(L, -4);
-	unsigned int val = lua_tonumber(L, -3);
-	double x = lua_tonumber(L, -2);
-	double y = lua_tonumber(L, -1);
-
+	drawn.glyph++;
 	int index = FT_Get_Char_Index(face, val);
 	cairo_glyph_t glyph = {index, x, y};
 
@@ -156,6 +290,18 @@ draw_glyph(lua_State *L)
 
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
 	cairo_show_glyphs(cr, &glyph, 1);
+}
+
+int
+draw_glyph(lua_State *L)
+{
+	double size = lua_tonumber(L, -4);
+	unsigned int val = lua_tonumber(L, -3);
+	double x = lua_tonumber(L, -2);
+	double y = lua_tonumber(L, -1);
+
+	luacalls++;
+	drawglyph(size, val, x, y);
 
 	return 0;
 }
@@ -165,6 +311,8 @@ glyph_extents(lua_State *L)
 {
 	unsigned int val = lua_tonumber(L, -2);
 	double size = lua_tonumber(L, -1);
+	luacalls++;
+	drawn.extents++;
 	unsigned int index = FT_Get_Char_Index(face, val);
 	cairo_glyph_t glyph = {index, 0, 0};
 	cairo_text_extents_t extents;
@@ -178,135 +326,363 @@ glyph_extents(lua_State *L)
 	return 2;
 }
 
-int
-putframe(AVFormatContext *fctx, const AVStream *st, AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt)
+// the encoder and the file it writes, along with the audio copied into it
+struct output {
+	AVFormatContext *fc;
+	AVCodecContext *c;
+	AVStream *vidstream;
+	AVStream *audiostream;
+	AVFormatContext *audioin;
+	AVStream *audioinstream;
+	AVPacket *pkt;
+	// the next audio packet, read ahead until the video catches up with it
+	AVPacket *audiopkt;
+	bool audiopending;
+	// where the audio for the first frame starts, in the input's time base
+	int64_t audiostart;
+};
+
+// copy the audio that starts before until, in microseconds, or all of it
+// if until is INT64_MAX, shifted to start with the video. audio is copied
+// as the video reaches it rather than after it, so the muxer doesn't have
+// to hold on to the video until the audio arrives, and players don't have
+// to seek across the whole file to play both.
+static void
+putaudio(struct output *out, int64_t until)
 {
+	if (!out->audioin)
+		return;
+
+	AVPacket *pkt = out->audiopkt;
+	AVRational tb = out->audioinstream->time_base;
+	for (;;) {
+		if (!out->audiopending) {
+			if (av_read_frame(out->audioin, pkt) < 0) {
+				avformat_close_input(&out->audioin);
+				return;
+			}
+			if (pkt->stream_index != out->audioinstream->index ||
+					(pkt->pts != AV_NOPTS_VALUE && pkt->pts < out->audiostart)) {
+				av_packet_unref(pkt);
+				continue;
+			}
+			if (pkt->pts != AV_NOPTS_VALUE)
+				pkt->pts -= out->audiostart;
+			if (pkt->dts != AV_NOPTS_VALUE)
+				pkt->dts -= out->audiostart;
+			out->audiopending = true;
+		}
+
+		int64_t t = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+		if (until != INT64_MAX && t != AV_NOPTS_VALUE && av_rescale_q(t, tb, AV_TIME_BASE_Q) >= until)
+			return;
+
+		av_packet_rescale_ts(pkt, tb, out->audiostream->time_base);
+		pkt->stream_index = out->audiostream->index;
+		out->audiopending = false;
+		if (av_interleaved_write_frame(out->fc, pkt) < 0) {
+			fprintf(stderr, "failed to write audio frame\n");
+			exit(1);
+		}
+	}
+}
+
+// encode frame and write the packets the encoder gives back, along with
+// the audio that goes before each. a NULL frame drains the encoder.
+static void
+putframe(struct output *out, AVFrame *frame)
+{
+	AVPacket *pkt = out->pkt;
 	int ret;
 
-	ret = avcodec_send_frame(ctx, frame);
+	double start = timing_now();
+	ret = avcodec_send_frame(out->c, frame);
 	if (ret < 0) {
 		fprintf(stderr, "error sending frame to encoder\n");
 		exit(1);
 	}
 
 	while (ret >= 0) {
-		ret = avcodec_receive_packet(ctx, pkt);
+		ret = avcodec_receive_packet(out->c, pkt);
+		timing_stage("encode", start);
 		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-			return 0;
+			return;
 		else if (ret < 0) {
-			fprintf(stderr, "error encoding audio frame\n");
+			fprintf(stderr, "error encoding video frame\n");
 			exit(1);
 		}
 
-		av_packet_rescale_ts(pkt, ctx->time_base, st->time_base);
-		pkt->stream_index = st->index;
+		av_packet_rescale_ts(pkt, out->c->time_base, out->vidstream->time_base);
+		pkt->stream_index = out->vidstream->index;
+
+		start = timing_now();
+		putaudio(out, av_rescale_q(pkt->dts, out->vidstream->time_base, AV_TIME_BASE_Q));
+		timing_stage("audio", start);
 
-		ret = av_interleaved_write_frame(fctx, pkt);
+		start = timing_now();
+		ret = av_interleaved_write_frame(out->fc, pkt);
+		timing_stage("write", start);
 		if (ret < 0) {
 			fprintf(stderr, "failed to write video frame\n");
 			exit(1);
 		}
+		start = timing_now();
 	}
 }
 
+#define FILENAME "out.mkv"
+#define PNGFILE "out.png"
+#define HASHSEED 0xcbf29ce484222325
+
+// pass the counts since the last report on to the timings
+static void
+reportdrawn(void)
+{
+	timing_count("draw_glyph", drawn.glyph);
+	timing_count("draw_line", drawn.line);
+	timing_count("draw_circle", drawn.circle);
+	timing_count("draw_quad", drawn.quad);
+	timing_count("draw_curve", drawn.curve);
+	timing_count("glyph_extents", drawn.extents);
+	timing_count("lua_to_c", luacalls);
+	timing_count("allocs", memory_allocs());
+	memset(&drawn, 0, sizeof(drawn));
+	luacalls = 0;
+}
+
+// map the score and register the functions that parse it and cache its
+// layout, replacing any score that was loaded before
 int
-putaudioframe(AVFormatContext *fctx, const AVStream *st, AVPacket *pkt)
+loadscore(lua_State *L)
 {
-	pkt->stream_index = st->index;
-	int ret = av_interleaved_write_frame(fctx, pkt);
-	if (ret < 0) {
-		fprintf(stderr, "failed to write video frame\n");
-		exit(1);
+	// map the score so that the parser can decode it in place
+	int scorefd = open(scorepath, O_RDONLY);
+	if (scorefd < 0) {
+		fprintf(stderr, "failed to open %s\n", scorepath);
+		return -1;
 	}
-}
 
-#define FILENAME "out.mkv"
+	struct stat st;
+	if (fstat(scorefd, &st) < 0) {
+		fprintf(stderr, "failed to stat score\n");
+		close(scorefd);
+		return -1;
+	}
+
+	size_t newlen = st.st_size;
+	char *newscore = "";
+	if (newlen) {
+		newscore = mmap(NULL, newlen, PROT_READ, MAP_PRIVATE, scorefd, 0);
+		if (newscore == MAP_FAILED) {
+			fprintf(stderr, "failed to map score\n");
+			close(scorefd);
+			return -1;
+		}
+	}
+	close(scorefd);
+
+	// load score parser
+	lua_pushlightuserdata(L, newscore);
+	lua_pushinteger(L, newlen);
+	lua_pushcclosure(L, parse_score, 2);
+	lua_setglobal(L, "parse");
+	lua_pushlightuserdata(L, newscore);
+	lua_pushinteger(L, newlen);
+	lua_pushcclosure(L, parse_measures, 2);
+	lua_setglobal(L, "parse_measures");
+
+	// the layout cache is keyed by everything that layout depends on, with
+	// the score kept separate so that an edited score can reuse part of it.
+	// the parser, lqmath and items are compiled in, so the binary itself
+	// is part of the key, and a rebuild starts with a fresh layout. it
+	// can't change while we run, so it is only hashed once.
+	static uint64_t exekey;
+	if (!exekey)
+		exekey = cache_hashfile(HASHSEED, "/proc/self/exe");
+	uint64_t codekey = cache_hashfile(exekey, layoutpath);
+	codekey = cache_hashfile(codekey, fontpath);
+	uint64_t scorekey = cache_hash(HASHSEED, newscore, newlen);
+	lua_pushstring(L, cachepath);
+	lua_pushinteger(L, codekey);
+	lua_pushinteger(L, scorekey);
+	lua_pushcclosure(L, cache_load, 3);
+	lua_setglobal(L, "cache_load");
+	lua_pushstring(L, savecache ? cachepath : NULL);
+	lua_pushinteger(L, codekey);
+	lua_pushinteger(L, scorekey);
+	lua_pushcclosure(L, cache_save, 3);
+	lua_setglobal(L, "cache_save");
+
+	if (scorelen)
+		munmap(score, scorelen);
+	score = newscore;
+	scorelen = newlen;
 
+	return 0;
+}
+
+// draw the frame at time to the surface, returning 1 once the animation
+// is over, or -1 if drawframe_at failed
 int
-main(int argc, char *argv[])
+renderframe(lua_State *L, double time)
 {
-	lua_State *L = luaL_newstate();
-	luaL_openlibs(L);
+	/* fill with white */
+	double start = timing_now();
+	cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+	cairo_rectangle(cr, 0, 0, width, height);
+	cairo_fill(cr);
+	timing_stage("fill", start);
+	// draw frame
+	start = timing_now();
+	profile_enter();
+	lua_getglobal(L, "drawframe_at");
+	lua_pushnumber(L, time);
+	int err = lua_pcall(L, 1, 1, 0);
+	profile_leave();
+	if (err) {
+		fprintf(stderr, "lua error: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return -1;
+	}
 
-	// load lqmath
-	lua_newtable(L);
-	luaopen_qmath(L);
-	lua_setglobal(L, "Q");
+	bool done = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	timing_stage("draw", start);
 
-	// load drawing primitives
-	lua_pushcfunction(L, draw_curve);
-	lua_setglobal(L, "draw_curve");
-	lua_pushcfunction(L, draw_glyph);
-	lua_setglobal(L, "draw_glyph");
-	lua_pushcfunction(L, draw_circle);
-	lua_setglobal(L, "draw_circle");
-	lua_pushcfunction(L, draw_line);
-	lua_setglobal(L, "draw_line");
-	lua_pushcfunction(L, draw_quad);
-	lua_setglobal(L, "draw_quad");
-	lua_pushcfunction(L, glyph_extents);
-	lua_setglobal(L, "glyph_extents");
-	lua_pushnumber(L, HEIGHT);
-	lua_setglobal(L, "frameheight");
-	lua_pushnumber(L, WIDTH);
-	lua_setglobal(L, "framewidth");
-	FT_Library library;
-	int error = FT_Init_FreeType(&library);
+	start = timing_now();
+	cairo_surface_flush(surface);
+	timing_stage("flush", start);
 
-	// TODO: print the actual error
-	if (error) {
-		fprintf(stderr, "freetype init error");
-		return 1;
+	if (gc.step) {
+		start = timing_now();
+		lua_gc(L, LUA_GCSTEP, gc.step);
+		timing_stage("gc", start);
 	}
 
-	error = FT_New_Face(library, "/usr/share/fonts/OTF/Bravura.otf", 0, &face);
+	reportdrawn();
+
+	return done;
+}
+
+// run the script, which parses the score and lays it out unless the cache
+// is fresh, returning -1 if it failed
+int
+runscript(lua_State *L)
+{
+	double start = timing_now();
+	memory_phase("script");
+	lua_gc(L, gc.stoplayout ? LUA_GCSTOP : LUA_GCRESTART, 0);
+	profile_enter();
+	int error = luaL_dofile(L, scriptpath);
+	profile_leave();
 	if (error) {
-		fprintf(stderr, "freetype font load error");
-		return 1;
+		fprintf(stderr, "lua error: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
 	}
+	timing_phase("script", start);
 
-	cface = cairo_ft_font_face_create_for_ft_face(face, 0);
-	if (!cface) {
-		fprintf(stderr, "cairo font face load error");
-		return 1;
+	if (gc.stoplayout) {
+		start = timing_now();
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		timing_phase("gc", start);
 	}
+	lua_gc(L, gc.step ? LUA_GCSTOP : LUA_GCRESTART, 0);
 
-	AVPacket *pkt = av_packet_alloc();
-	if (!pkt) {
-		fprintf(stderr, "couldn't allocate packet!\n");
-		return 1;
-	}
+	return error ? -1 : 0;
+}
 
-	AVFrame *frame = av_frame_alloc();
-	if (!frame) {
-		fprintf(stderr, "couldn't allocate frame!\n");
-		return 1;
-	}
+// report errors outside of any pcall before lua aborts, as luaL_newstate's
+// panic function would
+static int
+panic(lua_State *L)
+{
+	const char *msg = lua_tostring(L, -1);
+	fprintf(stderr, "lua panic: %s\n", msg ? msg : "error object is not a string");
+	return 0;
+}
 
-	// load audio data
-	AVFormatContext *audioin = NULL;
-	if (avformat_open_input(&audioin, "file:intermezzo.webm", NULL, NULL) < 0) {
-		fprintf(stderr, "failed to open audio data\n");
+// path with suffix appended, in memory that is never freed
+static char *
+suffixed(const char *path, const char *suffix)
+{
+	char *s = malloc(strlen(path) + strlen(suffix) + 1);
+	if (s)
+		strcat(strcpy(s, path), suffix);
+	return s;
+}
+
+// the path of name in the directory of path, in memory that is never freed
+static char *
+sibling(const char *path, const char *name)
+{
+	const char *slash = strrchr(path, '/');
+	size_t dirlen = slash ? slash - path + 1 : 0;
+	char *s = malloc(dirlen + strlen(name) + 1);
+	if (s) {
+		memcpy(s, path, dirlen);
+		strcpy(s + dirlen, name);
 	}
+	return s;
+}
 
-	int index = av_find_best_stream(audioin, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-	if (index < 0) {
-		fprintf(stderr, "failed to find audio stream\n");
-		return 1;
+static bool
+number(const char *s, double *out)
+{
+	char *end;
+	*out = strtod(s, &end);
+	return *s && !*end && isfinite(*out) && *out >= 0;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--watch] [--start seconds] [--end seconds] [--frame n] [--size widthxheight] [--null-output] [--checksums] [--timing] [--timing-file path] [--profile path] [--memory] [--gc generational|incremental] [--gc-pause percent] [--gc-stepmul percent] [--gc-step kilobytes] [--gc-stop-layout] [--score path] [--script path] [--font path] [--audio path|-] [--output path] [--format name] [--batch manifest] [--jobs n]\n", argv0);
+	exit(1);
+}
+
+// set up the encoder and the output file and write its header, with the
+// audio starting at frame first, returning -1 on failure. either way,
+// freeoutput frees whatever was set up.
+static int
+openoutput(struct output *out, long first)
+{
+	double start = timing_now();
+
+	out->pkt = av_packet_alloc();
+	out->audiopkt = av_packet_alloc();
+	if (!out->pkt || !out->audiopkt) {
+		fprintf(stderr, "couldn't allocate packet!\n");
+		return -1;
 	}
 
-	AVStream *audioinstream = audioin->streams[index];
+	// load audio data. without it, as asked for with --audio - or a batch
+	// job's -, such as for a score that hasn't been recorded yet, the video
+	// is written on its own.
+	if (!audiopath) {
+		// rendering without audio
+	} else if (avformat_open_input(&out->audioin, audiopath, NULL, NULL) < 0) {
+		fprintf(stderr, "failed to open %s\n", audiopath);
+		return -1;
+	} else {
+		int index = av_find_best_stream(out->audioin, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+		if (index < 0) {
+			fprintf(stderr, "failed to find audio stream\n");
+			return -1;
+		}
+		out->audioinstream = out->audioin->streams[index];
+		out->audiostart = av_rescale_q(first, (AVRational){1, FRAMERATE}, out->audioinstream->time_base);
+	}
 
-	const AVOutputFormat *fmt = av_guess_format(NULL, FILENAME, NULL);
+	const AVOutputFormat *fmt = av_guess_format(outformat, outpath, NULL);
 	if (!fmt) {
-		fprintf(stderr, "unknown output format\n");
-		return 1;
+		fprintf(stderr, "unknown output format %s\n", outformat ? outformat : outpath);
+		return -1;
 	}
 
-	AVFormatContext *fc = avformat_alloc_context();
+	AVFormatContext *fc = out->fc = avformat_alloc_context();
 	if (!fc) {
 		fprintf(stderr, "couldn't allocate AVFormatContext\n");
-		return 1;
+		return -1;
 	}
 
 	fc->oformat = fmt;
@@ -314,19 +690,21 @@ main(int argc, char *argv[])
 	const AVCodec *codec = avcodec_find_encoder_by_name("libx264rgb");
 	if (!codec) {
 		fprintf(stderr, "couldn't find h264 codec!\n");
-		return 1;
+		return -1;
 	}
 
-	AVStream *vidstream = avformat_new_stream(fc, NULL);
-	vidstream->id = fc->nb_streams-1;
+	out->vidstream = avformat_new_stream(fc, NULL);
+	out->vidstream->id = fc->nb_streams-1;
 
-	AVStream *audiostream = avformat_new_stream(fc, NULL);
-	vidstream->id = fc->nb_streams-1;
+	if (out->audioinstream) {
+		out->audiostream = avformat_new_stream(fc, NULL);
+		out->audiostream->id = fc->nb_streams-1;
+	}
 
-	AVCodecContext *c = avcodec_alloc_context3(codec);
+	AVCodecContext *c = out->c = avcodec_alloc_context3(codec);
 	if (!c) {
 		fprintf(stderr, "couldn't alloc AVCodec context!\n");
-		return 1;
+		return -1;
 	}
 
 	if (fc->oformat->flags & AVFMT_GLOBALHEADER)
@@ -335,93 +713,160 @@ main(int argc, char *argv[])
 	// suggested bitrates: https://www.videoproc.com/media-converter/bitrate-setting-for-h264.htm
 	c->codec_id = codec->id;
 	c->bit_rate = 2500*1000;
-	c->width = WIDTH;
-	c->height = HEIGHT;
+	c->width = width;
+	c->height = height;
 	c->time_base.num = 1;
 	c->time_base.den = FRAMERATE;
 	c->framerate.num = FRAMERATE;
 	c->framerate.den = 1;
 	c->pix_fmt = AV_PIX_FMT_RGB24;
 	c->gop_size = 30*3;
+	c->thread_count = encthreads;
 	AVDictionary *opts = NULL;
 
-	vidstream->time_base = c->time_base;
-	frame->format = c->pix_fmt;
-	frame->width = c->width;
-	frame->height = c->height;
+	out->vidstream->time_base = c->time_base;
 
 	if (avcodec_open2(c, codec, &opts) < 0) {
 		fprintf(stderr, "failed to open codec\n");
-		return 1;
-	}
-
-	if (av_frame_get_buffer(frame, 0) < 0) {
-		fprintf(stderr, "couldn't allocate frame data\n");
-		return 1;
-	}
-
-	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, WIDTH, HEIGHT);
-	cr = cairo_create(surface);
-
-	cairo_set_font_face(cr, cface);
-	cairo_set_font_size(cr, 32.0);
-	if (av_frame_make_writable(frame) < 0) {
-		fprintf(stderr, "couldn't make frame writeable\n");
-		return 1;
-	}
-
-	if (luaL_dofile(L, "smallpond.lua")) {
-		fprintf(stderr, "lua error: %s\n", lua_tostring(L, -1));
-		return 1;
+		return -1;
 	}
 
 	if (!(fmt->flags & AVFMT_NOFILE)) {
-		if (avio_open(&fc->pb, FILENAME, AVIO_FLAG_WRITE) < 0) {
-			fprintf(stderr, "failed to open output file\n");
+		if (avio_open(&fc->pb, outpath, AVIO_FLAG_WRITE) < 0) {
+			fprintf(stderr, "failed to open %s\n", outpath);
+			return -1;
 		}
 	}
 
-	if (avcodec_parameters_from_context(vidstream->codecpar, c) < 0) {
+	if (avcodec_parameters_from_context(out->vidstream->codecpar, c) < 0) {
 		fprintf(stderr, "failed to copy stream parameters\n");
-		return 1;
+		return -1;
 	}
 
-	if (avcodec_parameters_copy(audiostream->codecpar, audioinstream->codecpar) < 0) {
+	if (out->audiostream && avcodec_parameters_copy(out->audiostream->codecpar, out->audioinstream->codecpar) < 0) {
 		fprintf(stderr, "failed to copy stream parameters\n");
-		return 1;
+		return -1;
 	}
 
+	timing_phase("encoder", start);
+
+	start = timing_now();
 	int ret;
 	if ((ret = avformat_write_header(fc, NULL)) < 0) {
 		fprintf(stderr, "failed to write header: %s\n", av_err2str(ret));
-		return 1;
+		return -1;
 	}
+	timing_phase("header", start);
 
+	return 0;
+}
+
+// free everything openoutput set up, as far as it got
+static void
+freeoutput(struct output *out)
+{
+	avformat_close_input(&out->audioin);
+	avcodec_free_context(&out->c);
+	av_packet_free(&out->pkt);
+	av_packet_free(&out->audiopkt);
+
+	if (out->fc) {
+		avio_closep(&out->fc->pb);
+		avformat_free_context(out->fc);
+		out->fc = NULL;
+	}
+}
+
+// drain the encoder, copy the rest of the audio up to the end of the
+// video, which is frames long, or all of it if frames is negative, and
+// finish the output. like the video, the audio then counts from the first
+// frame rendered.
+static void
+closeoutput(struct output *out, long frames)
+{
+	double start = timing_now();
+	putframe(out, NULL);
+	timing_phase("drain", start);
+
+	start = timing_now();
+	if (out->audioin)
+		putaudio(out, frames >= 0 ? av_rescale_q(frames, (AVRational){1, FRAMERATE}, AV_TIME_BASE_Q) : INT64_MAX);
+	timing_phase("audio", start);
+
+	start = timing_now();
+	av_write_trailer(out->fc);
+	timing_phase("trailer", start);
+
+	freeoutput(out);
+}
+
+// a hash of the pixels of frame, leaving out the padding at the end of
+// each row
+static uint64_t
+framehash(const AVFrame *frame)
+{
+	uint64_t h = HASHSEED;
+	for (int y = 0; y < frame->height; y++)
+		h = cache_hash(h, frame->data[0] + y * frame->linesize[0], 3 * frame->width);
+	return h;
+}
+
+// render the frames from first up to last, or to the end if last is
+// negative, into outpath, returning -1 on failure
+int
+render(lua_State *L, long first, long last)
+{
+	AVFrame *frame = av_frame_alloc();
+	if (!frame) {
+		fprintf(stderr, "couldn't allocate frame!\n");
+		return -1;
+	}
+
+	frame->format = AV_PIX_FMT_RGB24;
+	frame->width = width;
+	frame->height = height;
+
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		fprintf(stderr, "couldn't allocate frame data\n");
+		av_frame_free(&frame);
+		return -1;
+	}
+
+	// with --null-output, frames go through everything but the encoder
+	struct output out = {0};
+	if (!nullout && openoutput(&out, first) < 0) {
+		freeoutput(&out);
+		av_frame_free(&frame);
+		return -1;
+	}
+
+	memory_phase("frames");
 	bool done = false;
-	double time = 0;
-	int framecount = 0;
-	int aframe = 0;
-	while (!done) {
-		/* fill with white */
-		cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-		cairo_rectangle(cr, 0, 0, WIDTH, HEIGHT);
-		cairo_fill(cr);
-		// draw frame
-		lua_getglobal(L, "drawframe");
-		lua_pushnumber(L, time);
-		lua_call(L, 1, 1);
-
-		done = lua_toboolean(L, -1);
-
-		cairo_surface_flush(surface);
+	long framecount = first;
+	while (!done && (last < 0 || framecount < last)) {
+		// every frame's time is computed from its number, so that a range
+		// renders exactly as it would as part of the whole animation
+		double time = (double)framecount / FRAMERATE;
+		timing_frame(framecount);
+		int r = renderframe(L, time);
+		if (r < 0) {
+			freeoutput(&out);
+			av_frame_free(&frame);
+			return -1;
+		}
+		done = r;
+
+		double start = timing_now();
 		uint8_t *image_data = cairo_image_surface_get_data(surface);
 		if (av_frame_make_writable(frame) < 0) {
 			fprintf(stderr, "couldn't make frame writeable\n");
-			return 1;
+			freeoutput(&out);
+			av_frame_free(&frame);
+			return -1;
 		}
 
-		for (int y = 0; y < HEIGHT; y++) {
-			for (int x = 0; x < WIDTH; x++) {
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
 				int srcoffset = cairo_image_surface_get_stride(surface) * y + 4*x;
 				uint32_t val = *(uint32_t *)(image_data + srcoffset);
 				// we are assuming RGB24 here
@@ -433,28 +878,289 @@ main(int argc, char *argv[])
 			}
 		}
 
+		timing_stage("repack", start);
+
+		if (checksums) {
+			start = timing_now();
+			printf("%ld %016" PRIx64 "\n", framecount, framehash(frame));
+			timing_stage("checksum", start);
+		}
+
 		fflush(stdout);
-		frame->pts = framecount;
-		putframe(fc, vidstream, c, frame, pkt);
-		time += 1.0 / FRAMERATE;
+		frame->pts = framecount - first;
+		if (!nullout)
+			putframe(&out, frame);
 		framecount += 1;
 	}
 
-	while (av_read_frame(audioin, pkt) >= 0) {
-		pkt->stream_index = audiostream->index;
-		av_interleaved_write_frame(fc, pkt);
+	if (!nullout)
+		closeoutput(&out, last >= 0 ? framecount - first : -1);
+
+	av_frame_free(&frame);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool watching = false;
+	// a manifest of jobs to render, and how many to render at a time
+	const char *manifest = NULL;
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	// where to write the collapsed stacks of the lua profiler
+	const char *profilepath = NULL;
+	// whether --timing, --timing-file or --memory asked for a report
+	bool reporting = false;
+	// frames are numbered from 0 at time 0, and the range is [first, last)
+	long first = 0, last = -1;
+	// a single frame to write as an image
+	long single = -1;
+	for (int i = 1; i < argc; i++) {
+		double n;
+		if (strcmp(argv[i], "--watch") == 0) {
+			watching = true;
+		} else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc && number(argv[i + 1], &n)) {
+			first = lround(n * FRAMERATE);
+			i++;
+		} else if (strcmp(argv[i], "--end") == 0 && i + 1 < argc && number(argv[i + 1], &n)) {
+			last = lround(n * FRAMERATE);
+			i++;
+		} else if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc && number(argv[i + 1], &n) && n == floor(n)) {
+			single = n;
+			i++;
+		} else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			char c;
+			if (sscanf(argv[++i], "%dx%d%c", &width, &height, &c) != 2 || width <= 0 || height <= 0)
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "--null-output") == 0) {
+			nullout = true;
+		} else if (strcmp(argv[i], "--checksums") == 0) {
+			checksums = true;
+		} else if (strcmp(argv[i], "--timing") == 0) {
+			timing_enable(NULL);
+			reporting = true;
+		} else if (strcmp(argv[i], "--timing-file") == 0 && i + 1 < argc) {
+			timing_enable(argv[++i]);
+			reporting = true;
+		} else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profilepath = argv[++i];
+		} else if (strcmp(argv[i], "--memory") == 0) {
+			memory_enable();
+			reporting = true;
+		} else if (strcmp(argv[i], "--gc") == 0 && i + 1 < argc) {
+			i++;
+#if LUA_VERSION_NUM >= 504
+			if (strcmp(argv[i], "generational") == 0)
+				gc.mode = LUA_GCGEN;
+			else if (strcmp(argv[i], "incremental") == 0)
+				gc.mode = LUA_GCINC;
+			else
+				usage(argv[0]);
+#else
+			if (strcmp(argv[i], "generational") == 0) {
+				fprintf(stderr, "--gc generational needs lua 5.4\n");
+				return 1;
+			} else if (strcmp(argv[i], "incremental") != 0) {
+				usage(argv[0]);
+			}
+#endif
+		} else if (strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc && number(argv[i + 1], &n) && n >= 1) {
+			gc.pause = n;
+			i++;
+		} else if (strcmp(argv[i], "--gc-stepmul") == 0 && i + 1 < argc && number(argv[i + 1], &n) && n >= 1) {
+			gc.stepmul = n;
+			i++;
+		} else if (strcmp(argv[i], "--gc-step") == 0 && i + 1 < argc && number(argv[i + 1], &n) && n >= 1) {
+			gc.step = n;
+			i++;
+		} else if (strcmp(argv[i], "--gc-stop-layout") == 0) {
+			gc.stoplayout = true;
+		} else if (strcmp(argv[i], "--score") == 0 && i + 1 < argc) {
+			scorepath = argv[++i];
+		} else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+			scriptpath = argv[++i];
+		} else if (strcmp(argv[i], "--font") == 0 && i + 1 < argc) {
+			fontpath = argv[++i];
+		} else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+			audiopath = argv[++i];
+			if (strcmp(audiopath, "-") == 0)
+				audiopath = NULL;
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			outpath = argv[++i];
+		} else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			outformat = argv[++i];
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			manifest = argv[++i];
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc && number(argv[i + 1], &n) && n >= 1 && n == floor(n)) {
+			workers = n;
+			i++;
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	if (last >= 0 && last <= first) {
+		fprintf(stderr, "--end must come after --start\n");
+		return 1;
+	}
+	if (manifest && (watching || single >= 0 || checksums)) {
+		fprintf(stderr, "--batch can't be used with --watch, --frame or --checksums\n");
+		return 1;
+	}
+	// the workers would each report for their own jobs, over each other
+	if (manifest && (reporting || profilepath)) {
+		fprintf(stderr, "--batch can't be used with --timing, --timing-file, --memory or --profile\n");
+		return 1;
+	}
+	if (workers < 1)
+		workers = 1;
+#if LUA_VERSION_NUM >= 504
+	if (gc.mode == LUA_GCGEN && (gc.pause || gc.stepmul)) {
+		fprintf(stderr, "--gc-pause and --gc-stepmul are for the incremental collector\n");
+		return 1;
+	}
+#endif
+
+	if (!outpath)
+		outpath = single >= 0 ? PNGFILE : FILENAME;
+	cachepath = suffixed(scorepath, ".cache");
+	layoutpath = sibling(scriptpath, "layout.lua");
+	if (!cachepath || !layoutpath) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
 	}
 
-	av_write_trailer(fc);
+	double start = timing_now();
+	// everything lua and the rationals allocate is accounted for
+	memory_phase("startup");
+	mp_int_alloc_hook(memory_digits);
+	lua_State *L = lua_newstate(memory_alloc, NULL);
+	if (!L) {
+		fprintf(stderr, "failed to create lua state\n");
+		return 1;
+	}
+	lua_atpanic(L, panic);
+#if LUA_VERSION_NUM >= 504
+	if (gc.mode == LUA_GCGEN)
+		lua_gc(L, LUA_GCGEN, 0, 0);
+	else if (gc.mode == LUA_GCINC || gc.pause || gc.stepmul)
+		lua_gc(L, LUA_GCINC, gc.pause, gc.stepmul, 0);
+#else
+	if (gc.pause)
+		lua_gc(L, LUA_GCSETPAUSE, gc.pause);
+	if (gc.stepmul)
+		lua_gc(L, LUA_GCSETSTEPMUL, gc.stepmul);
+#endif
+	luaL_openlibs(L);
 
-	avcodec_free_context(&c);
-	av_frame_free(&frame);
-	av_packet_free(&pkt);
+	// load lqmath
+	lua_newtable(L);
+	luaopen_qmath(L);
+	lua_setglobal(L, "Q");
+	if (profilepath)
+		profile_start(L);
+	timing_phase("lua", start);
 
-	avio_closep(&fc->pb);
-	avformat_free_context(fc);
+	start = timing_now();
+	if (loadscore(L) < 0)
+		return 1;
+	timing_phase("score", start);
+
+	// load drawing primitives
+	lua_pushcfunction(L, draw_curve);
+	lua_setglobal(L, "draw_curve");
+	lua_pushcfunction(L, draw_glyph);
+	lua_setglobal(L, "draw_glyph");
+	lua_pushcfunction(L, draw_circle);
+	lua_setglobal(L, "draw_circle");
+	lua_pushcfunction(L, draw_line);
+	lua_setglobal(L, "draw_line");
+	lua_pushcfunction(L, draw_quad);
+	lua_setglobal(L, "draw_quad");
+	lua_pushcfunction(L, glyph_extents);
+	lua_setglobal(L, "glyph_extents");
+	items_open(L);
+	lua_pushcfunction(L, items_new);
+	lua_setglobal(L, "items_new");
+	lua_pushcfunction(L, memory_lphase);
+	lua_setglobal(L, "memory_phase");
+	lua_pushnumber(L, height);
+	lua_setglobal(L, "frameheight");
+	lua_pushnumber(L, width);
+	lua_setglobal(L, "framewidth");
+	lua_pushstring(L, layoutpath);
+	lua_setglobal(L, "layoutpath");
+	start = timing_now();
+	FT_Library library;
+	int error = FT_Init_FreeType(&library);
+	timing_phase("freetype", start);
+
+	// TODO: print the actual error
+	if (error) {
+		fprintf(stderr, "freetype init error");
+		return 1;
+	}
+
+	start = timing_now();
+	error = FT_New_Face(library, fontpath, 0, &face);
+	if (error) {
+		fprintf(stderr, "freetype font load error");
+		return 1;
+	}
+
+	cface = cairo_ft_font_face_create_for_ft_face(face, 0);
+	if (!cface) {
+		fprintf(stderr, "cairo font face load error");
+		return 1;
+	}
+	timing_phase("font", start);
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cr = cairo_create(surface);
+
+	cairo_set_font_face(cr, cface);
+	cairo_set_font_size(cr, 32.0);
+
+	if (watching)
+		return watch(L, FRAMERATE);
+	if (manifest)
+		return batch(L, manifest, workers, first, last);
+
+	if (runscript(L) < 0)
+		return 1;
+	reportdrawn();
+
+	if (single >= 0) {
+		timing_frame(single);
+		if (renderframe(L, (double)single / FRAMERATE) < 0)
+			return 1;
+		start = timing_now();
+		if (cairo_surface_write_to_png(surface, outpath) != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "failed to write %s\n", outpath);
+			return 1;
+		}
+		timing_stage("png", start);
+		timing_report();
+		memory_report();
+		if (profilepath)
+			profile_report(profilepath);
+		return 0;
+	}
+
+	if (render(L, first, last) < 0)
+		return 1;
 
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
+	// before closing lua, so that anything still held shows as growth
+	memory_report();
 	lua_close(L);
-}
\ No newline at end of file
+
+	if (scorelen)
+		munmap(score, scorelen);
+
+	timing_report();
+	if (profilepath)
+		profile_report(profilepath);
+}
@@ -0,0 +1,186 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// accounting of the memory held by lua, which goes through memory_alloc,
+// and by the digits of lqmath's rationals, which imath reports to
+// memory_digits. the rationals themselves are lua userdata, so between
+// them these cover nearly all of the memory layout and drawing use.
+//
+// the accounting is split into phases, which are named by whoever starts
+// them, in C with memory_phase or in lua with the function of the same
+// name. each phase gets the number of allocations made in it, the bytes
+// they asked for, the peak of the memory in use while it ran and how much
+// that changed over it. a phase that is entered again, like the parsing
+// and placement of each measure, adds to what it had before.
+
+#define MAXPHASES 16
+
+struct pool {
+	size_t live;
+	size_t peak;
+};
+
+struct phase {
+	const char *name;
+	unsigned long allocs;
+	double bytes;
+	size_t peak;
+	double growth;
+};
+
+static bool enabled;
+
+static struct pool lua, digits;
+
+static struct phase phases[MAXPHASES];
+static int nphases;
+
+// the phase running now, and where it started
+static int current = -1;
+static unsigned long allocs;
+static double bytes;
+static size_t phasepeak;
+static size_t phasestart;
+
+// allocations since the last call to memory_allocs
+static unsigned long counted;
+
+// print the accounting to stderr at exit
+void
+memory_enable(void)
+{
+	enabled = true;
+}
+
+static void
+grow(struct pool *p, size_t osize, size_t nsize)
+{
+	p->live += nsize - osize;
+	if (p->live > p->peak)
+		p->peak = p->live;
+	if (nsize > osize) {
+		allocs++;
+		counted++;
+		bytes += nsize - osize;
+		if (lua.live + digits.live > phasepeak)
+			phasepeak = lua.live + digits.live;
+	}
+}
+
+// the allocator given to lua_newstate
+void *
+memory_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	(void)ud;
+	// without a block, osize is the type of the object being allocated
+	if (!ptr)
+		osize = 0;
+
+	if (nsize == 0) {
+		free(ptr);
+		grow(&lua, osize, 0);
+		return NULL;
+	}
+
+	void *p = realloc(ptr, nsize);
+	if (p)
+		grow(&lua, osize, nsize);
+	return p;
+}
+
+// the hook given to mp_int_alloc_hook
+void
+memory_digits(long delta)
+{
+	grow(&digits, digits.live, digits.live + delta);
+}
+
+// add what happened since the current phase started to it
+static void
+endphase(void)
+{
+	size_t live = lua.live + digits.live;
+	if (current >= 0) {
+		struct phase *p = &phases[current];
+		p->allocs += allocs;
+		p->bytes += bytes;
+		if (phasepeak > p->peak)
+			p->peak = phasepeak;
+		p->growth += (double)live - phasestart;
+	}
+
+	allocs = 0;
+	bytes = 0;
+	phasepeak = live;
+	phasestart = live;
+}
+
+// end the current phase, if any, and start accounting to phase
+void
+memory_phase(const char *phase)
+{
+	endphase();
+
+	int i;
+	for (i = 0; i < nphases; i++) {
+		if (strcmp(phases[i].name, phase) == 0)
+			break;
+	}
+	if (i == nphases) {
+		if (nphases == MAXPHASES) {
+			current = -1;
+			return;
+		}
+		phases[nphases++] = (struct phase){.name = phase};
+	}
+
+	current = i;
+}
+
+// memory_phase(name) from lua. the name is kept until exit, so it is
+// interned in the registry.
+int
+memory_lphase(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+	lua_pushvalue(L, 1);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	memory_phase(lua_tostring(L, 1));
+	return 0;
+}
+
+// the number of allocations since the last call
+unsigned long
+memory_allocs(void)
+{
+	unsigned long n = counted;
+	counted = 0;
+	return n;
+}
+
+// print the peaks and the accounting of each phase to stderr
+void
+memory_report(void)
+{
+	if (!enabled)
+		return;
+
+	endphase();
+
+	double mb = 1 << 20;
+	fprintf(stderr, "peak memory %.1f MB lua, %.1f MB rationals\n", lua.peak / mb, digits.peak / mb);
+	fprintf(stderr, "live memory %.1f MB lua, %.1f MB rationals\n\n", lua.live / mb, digits.live / mb);
+	fprintf(stderr, "%-10s %10s %10s %10s %10s\n", "phase", "allocs", "alloc MB", "peak MB", "growth MB");
+	for (int i = 0; i < nphases; i++) {
+		const struct phase *p = &phases[i];
+		fprintf(stderr, "%-10s %10lu %10.1f %10.1f %10.1f\n",
+			p->name, p->allocs, p->bytes / mb, p->peak / mb, p->growth / mb);
+	}
+}
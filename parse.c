@@ -0,0 +1,725 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// single pass parser for the .sp score format. it builds the same
+// voices and stafforder tables that smallpond.lua consumes.
+
+#define MEASURESEED 0xcbf29ce484222325
+
+uint64_t cache_hash(uint64_t h, const void *data, size_t len);
+
+struct parser {
+	lua_State *L;
+	const char *text;
+	size_t len;
+	size_t i;
+};
+
+struct column {
+	int stemdir;
+	int beam;
+	lua_Integer count;
+	bool hascount;
+	bool dot;
+};
+
+static void
+skipspace(struct parser *p)
+{
+	while (p->i < p->len && isspace((unsigned char)p->text[p->i]))
+		p->i++;
+}
+
+static bool
+atend(struct parser *p)
+{
+	// matches the original lua parser, which stops one character early
+	return p->i + 1 >= p->len;
+}
+
+static size_t
+spanof(struct parser *p, size_t i, int (*class)(int))
+{
+	size_t start = i;
+	while (i < p->len && class((unsigned char)p->text[i]))
+		i++;
+	return i - start;
+}
+
+static bool
+oneof(char c, const char *set)
+{
+	return c && strchr(set, c);
+}
+
+static lua_Integer
+readint(const char *s, size_t len)
+{
+	lua_Integer n = 0;
+	for (size_t i = 0; i < len; i++)
+		n = 10*n + (s[i] - '0');
+	return n;
+}
+
+// if a command like \voice starts at the cursor, return the length of its
+// name and store the name's position in *name
+static size_t
+command(struct parser *p, const char **name)
+{
+	if (p->i >= p->len || p->text[p->i] != '\\')
+		return 0;
+	*name = p->text + p->i + 1;
+	return spanof(p, p->i + 1, isalpha);
+}
+
+static bool
+iscommand(const char *name, size_t len, const char *want)
+{
+	return len == strlen(want) && memcmp(name, want, len) == 0;
+}
+
+static void
+pushname(struct parser *p)
+{
+	skipspace(p);
+	size_t len = spanof(p, p->i, isalpha);
+	if (len == 0)
+		luaL_error(p->L, "expected name at offset %d", (int)p->i);
+	lua_pushlstring(p->L, p->text + p->i, len);
+	p->i += len;
+}
+
+// decode a time like 12 or 5.658 straight from the text, giving the same
+// value tonumber would. returns false, pushing nothing, if there are no
+// digits.
+static bool
+pushtime(lua_State *L, const char *s, size_t len)
+{
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+		1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+	lua_Integer mant = 0;
+	int digits = 0, frac = 0;
+	bool dot = false;
+
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '.') {
+			dot = true;
+			continue;
+		}
+		// past 15 digits the text is handed to lua below, so stop before
+		// the mantissa can overflow
+		if (digits < 15)
+			mant = 10*mant + (s[i] - '0');
+		digits++;
+		if (dot)
+			frac++;
+	}
+
+	if (digits == 0)
+		return false;
+
+	// with at most 15 digits both the mantissa and the power of ten are
+	// exact doubles, so a single division rounds correctly
+	if (digits > 15) {
+		char buf[64];
+		if (len >= sizeof(buf))
+			return luaL_error(L, "note time too long");
+		memcpy(buf, s, len);
+		buf[len] = '\0';
+		return lua_stringtonumber(L, buf) != 0;
+	}
+
+	if (dot)
+		lua_pushnumber(L, mant / pow10[frac]);
+	else
+		lua_pushinteger(L, mant);
+
+	return true;
+}
+
+// parse a single note like 12.5fs,~ and push a table for it, returning
+// the note name
+static char
+pushnote(struct parser *p)
+{
+	lua_State *L = p->L;
+	size_t start = p->i, i = p->i;
+
+	i += spanof(p, i, isdigit);
+	if (i < p->len && p->text[i] == '.')
+		i++;
+	i += spanof(p, i, isdigit);
+	size_t timelen = i - start;
+
+	if (i >= p->len || !oneof(p->text[i], "abcdefgs"))
+		luaL_error(L, "unknown token at offset %d", (int)start);
+	char note = p->text[i++];
+	size_t acclen = i < p->len && oneof(p->text[i], "fns");
+
+	lua_newtable(L);
+	if (note == 's') {
+		lua_pushliteral(L, "srest");
+		lua_setfield(L, -2, "command");
+	} else {
+		lua_pushliteral(L, "note");
+		lua_setfield(L, -2, "command");
+
+		if (pushtime(L, p->text + start, timelen))
+			lua_setfield(L, -2, "time");
+
+		lua_pushlstring(L, &note, 1);
+		lua_setfield(L, -2, "note");
+
+		lua_pushlstring(L, p->text + i, acclen);
+		lua_setfield(L, -2, "acc");
+	}
+	i += acclen;
+
+	lua_Integer shift = 0;
+	for (; i < p->len; i++) {
+		if (p->text[i] == '\'')
+			shift++;
+		else if (p->text[i] == ',')
+			shift--;
+		else
+			break;
+	}
+	lua_pushinteger(L, shift);
+	lua_setfield(L, -2, "shift");
+
+	if (i < p->len && p->text[i] == '~') {
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "tie");
+		i++;
+	}
+
+	p->i = i;
+
+	return note;
+}
+
+// parse the stem direction, count, dot and beam that follow a note or chord
+static void
+parsecolumn(struct parser *p, struct column *col)
+{
+	const char *t = p->text;
+	size_t i = p->i;
+
+	memset(col, 0, sizeof(*col));
+
+	if (i < p->len && t[i] == 'v') {
+		col->stemdir = 1;
+		i++;
+	} else if (i < p->len && t[i] == '^') {
+		col->stemdir = -1;
+		i++;
+	}
+
+	size_t countlen = spanof(p, i, isdigit);
+	if (countlen) {
+		col->count = readint(t + i, countlen);
+		col->hascount = true;
+		if (col->count <= 0 || (col->count & (col->count - 1)))
+			luaL_error(p->L, "note count is not a power of 2");
+		i += countlen;
+	}
+
+	if (i < p->len && t[i] == '.') {
+		col->dot = true;
+		i++;
+	}
+
+	if (i < p->len && t[i] == '[') {
+		col->beam = 1;
+		i++;
+	} else if (i < p->len && t[i] == ']') {
+		col->beam = -1;
+		i++;
+	}
+
+	p->i = i;
+}
+
+static void
+setcolumn(lua_State *L, const struct column *col)
+{
+	if (col->hascount) {
+		lua_pushinteger(L, col->count);
+		lua_setfield(L, -2, "count");
+	}
+	if (col->stemdir) {
+		lua_pushinteger(L, col->stemdir);
+		lua_setfield(L, -2, "stemdir");
+	}
+	if (col->beam) {
+		lua_pushinteger(L, col->beam);
+		lua_setfield(L, -2, "beam");
+	}
+	lua_pushboolean(L, col->dot);
+	lua_setfield(L, -2, "dot");
+}
+
+static void
+newcommand(lua_State *L, const char *name)
+{
+	lua_newtable(L);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "command");
+}
+
+// find the end of a balanced pair starting at i, returning 0 if unbalanced
+static size_t
+balanced(struct parser *p, size_t i, char open, char close)
+{
+	int depth = 0;
+	for (; i < p->len; i++) {
+		if (p->text[i] == open)
+			depth++;
+		else if (p->text[i] == close && --depth == 0)
+			return i;
+	}
+	return 0;
+}
+
+// a grouping is some flags followed by notes in braces, like t3/2{...}.
+// returns true if one was found, with the position of the opening and
+// closing braces.
+static bool
+grouping(struct parser *p, size_t *open, size_t *close)
+{
+	size_t run = spanof(p, p->i, isgraph);
+	for (size_t j = p->i + run; j-- > p->i;) {
+		if (p->text[j] != '{')
+			continue;
+		size_t e = balanced(p, j, '{', '}');
+		if (e) {
+			*open = j;
+			*close = e;
+			return true;
+		}
+	}
+	return false;
+}
+
+// find t<num>/<denom> in the flags of a grouping
+static bool
+tuplet(const char *f, size_t len, lua_Integer *num, lua_Integer *denom)
+{
+	for (size_t j = 0; j < len; j++) {
+		if (f[j] != 't')
+			continue;
+		size_t k = j + 1, nlen = 0, dlen = 0;
+		while (k + nlen < len && isdigit((unsigned char)f[k + nlen]))
+			nlen++;
+		if (nlen == 0 || k + nlen >= len || f[k + nlen] != '/')
+			continue;
+		size_t d = k + nlen + 1;
+		while (d + dlen < len && isdigit((unsigned char)f[d + dlen]))
+			dlen++;
+		if (dlen == 0)
+			continue;
+		*num = readint(f + k, nlen);
+		*denom = readint(f + d, dlen);
+		return true;
+	}
+	return false;
+}
+
+// parse a voice command, i.e. \staff, \clef or \time, and push its table
+static void
+pushvoicecommand(struct parser *p, const char *name, size_t len)
+{
+	lua_State *L = p->L;
+
+	if (iscommand(name, len, "staff")) {
+		newcommand(L, "changestaff");
+		pushname(p);
+		lua_setfield(L, -2, "name");
+	} else if (iscommand(name, len, "clef")) {
+		newcommand(L, "changeclef");
+		skipspace(p);
+		size_t kindlen = spanof(p, p->i, isalpha);
+		const char *kind = p->text + p->i;
+		if (!iscommand(kind, kindlen, "treble") && !iscommand(kind, kindlen, "bass"))
+			luaL_error(L, "unknown clef %s", lua_pushlstring(L, kind, kindlen));
+		lua_pushlstring(L, kind, kindlen);
+		lua_setfield(L, -2, "kind");
+		p->i += kindlen;
+	} else if (iscommand(name, len, "time")) {
+		newcommand(L, "changetime");
+		skipspace(p);
+		const char *num = p->text + p->i;
+		size_t numlen = spanof(p, p->i, isdigit);
+		const char *denom = num + numlen + 1;
+		size_t denomlen = 0;
+		if (numlen && p->i + numlen < p->len && num[numlen] == '/')
+			denomlen = spanof(p, p->i + numlen + 1, isdigit);
+		if (denomlen == 0)
+			luaL_error(L, "bad time signature format");
+		lua_pushlstring(L, num, numlen);
+		lua_setfield(L, -2, "num");
+		lua_pushlstring(L, denom, denomlen);
+		lua_setfield(L, -2, "denom");
+		p->i += numlen + 1 + denomlen;
+	} else {
+		luaL_error(L, "unknown command \\%s", lua_pushlstring(L, name, len));
+	}
+}
+
+enum {
+	ITEM,
+	BARLINE,
+	VOICEEND,
+	TEXTEND,
+};
+
+// parse the next item of a voice and append it to the table at index
+// voice. returns BARLINE if the item was a barline, VOICEEND at \end, and
+// TEXTEND if the text ran out in the middle of the voice.
+static int
+nextitem(struct parser *p, int voice, lua_Integer *n)
+{
+	lua_State *L = p->L;
+
+	skipspace(p);
+	if (atend(p))
+		return TEXTEND;
+
+	const char *name = NULL;
+	size_t len = command(p, &name);
+	if (len) {
+		p->i += len + 1;
+		if (iscommand(name, len, "end"))
+			return VOICEEND;
+		pushvoicecommand(p, name, len);
+		lua_rawseti(L, voice, ++*n);
+		return ITEM;
+	}
+
+	// barline
+	if (p->text[p->i] == '|') {
+		p->i++;
+		newcommand(L, "barline");
+		lua_rawseti(L, voice, ++*n);
+		return BARLINE;
+	}
+
+	// grouping (grace or tuplet)
+	size_t open, close;
+	if (grouping(p, &open, &close)) {
+		const char *f = p->text + p->i;
+		size_t flen = open - p->i;
+		bool grace = memchr(f, 'g', flen) != NULL;
+		lua_Integer tn = 1, td = 1;
+		tuplet(f, flen, &tn, &td);
+
+		// TODO: deal with notegroups
+		p->i = open + 1;
+		while (p->i + 2 <= close) {
+			skipspace(p);
+			if (atend(p))
+				return TEXTEND;
+
+			newcommand(L, "newnotegroup");
+			lua_newtable(L);
+			pushnote(p);
+			lua_rawseti(L, -2, 1);
+			lua_setfield(L, -2, "notes");
+
+			struct column col;
+			parsecolumn(p, &col);
+			setcolumn(L, &col);
+
+			lua_getglobal(L, "Q");
+			lua_getfield(L, -1, "new");
+			lua_remove(L, -2);
+			lua_pushinteger(L, td);
+			lua_pushinteger(L, tn);
+			lua_call(L, 2, 1);
+			lua_setfield(L, -2, "tuplet");
+
+			lua_pushboolean(L, grace);
+			lua_setfield(L, -2, "grace");
+
+			lua_rawseti(L, voice, ++*n);
+		}
+		p->i = close + 1;
+		return ITEM;
+	}
+
+	// note column
+	if (p->text[p->i] == '<') {
+		size_t e = balanced(p, p->i, '<', '>');
+		if (e) {
+			p->i++;
+			newcommand(L, "newnotegroup");
+			lua_newtable(L);
+			lua_Integer nnotes = 0;
+			while (p->i < e) {
+				skipspace(p);
+				if (atend(p)) {
+					lua_pop(L, 2);
+					return TEXTEND;
+				}
+				pushnote(p);
+				lua_rawseti(L, -2, ++nnotes);
+			}
+			lua_setfield(L, -2, "notes");
+
+			p->i = e + 1;
+			struct column col;
+			parsecolumn(p, &col);
+			setcolumn(L, &col);
+
+			lua_rawseti(L, voice, ++*n);
+			return ITEM;
+		}
+	}
+
+	char note = pushnote(p);
+	struct column col;
+	parsecolumn(p, &col);
+
+	if (note == 's') {
+		lua_pop(L, 1);
+		newcommand(L, "srest");
+		if (col.hascount) {
+			lua_pushinteger(L, col.count);
+			lua_setfield(L, -2, "count");
+		}
+	} else {
+		newcommand(L, "newnotegroup");
+		lua_insert(L, -2);
+		lua_newtable(L);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 1);
+		lua_setfield(L, -2, "notes");
+		setcolumn(L, &col);
+	}
+	lua_rawseti(L, voice, ++*n);
+	return ITEM;
+}
+
+// parse the body of a \voice block and append it to the voices table at
+// index voices
+static void
+parsevoice(struct parser *p, int voices)
+{
+	lua_State *L = p->L;
+	lua_Integer n = 0;
+	// items up to the last barline
+	lua_Integer complete = 0;
+	int r;
+
+	lua_newtable(L);
+	int voice = lua_gettop(L);
+
+	while ((r = nextitem(p, voice, &n)) == ITEM || r == BARLINE) {
+		if (r == BARLINE)
+			complete = n;
+	}
+
+	// a voice that is cut off keeps its complete measures, as placement
+	// has them when the score is streamed with parse_measures, and is
+	// dropped if it has none
+	if (r == TEXTEND) {
+		for (; n > complete; n--) {
+			lua_pushnil(L);
+			lua_rawseti(L, voice, n);
+		}
+		if (complete == 0) {
+			lua_pop(L, 1);
+			return;
+		}
+	}
+
+	lua_rawseti(L, voices, lua_rawlen(L, voices) + 1);
+}
+
+// parse the body of a \layout block, appending staff names to the
+// stafforder table at index stafforder
+static void
+parselayout(struct parser *p, int stafforder)
+{
+	while (true) {
+		skipspace(p);
+		if (atend(p))
+			return;
+
+		const char *name = NULL;
+		size_t len = command(p, &name);
+		if (len)
+			p->i += len + 1;
+
+		if (len && iscommand(name, len, "end"))
+			return;
+
+		if (!len || !iscommand(name, len, "staff"))
+			luaL_error(p->L, "unknown token at offset %d", (int)p->i);
+
+		pushname(p);
+		lua_rawseti(p->L, stafforder, lua_rawlen(p->L, stafforder) + 1);
+	}
+}
+
+// parse len bytes of score text, pushing the voices and stafforder tables
+void
+parse_buffer(lua_State *L, const char *text, size_t len)
+{
+	struct parser p = {L, text, len, 0};
+
+	lua_newtable(L);
+	int voices = lua_gettop(L);
+	lua_newtable(L);
+	int stafforder = lua_gettop(L);
+
+	while (true) {
+		skipspace(&p);
+		if (atend(&p))
+			return;
+
+		const char *name = NULL;
+		size_t namelen = command(&p, &name);
+		if (!namelen)
+			luaL_error(L, "unknown token at offset %d", (int)p.i);
+		p.i += namelen + 1;
+
+		if (iscommand(name, namelen, "voice"))
+			parsevoice(&p, voices);
+		else if (iscommand(name, namelen, "layout"))
+			parselayout(&p, stafforder);
+		else
+			luaL_error(L, "unknown command \\%s", lua_pushlstring(L, name, namelen));
+	}
+}
+
+// the text to parse: the string at index arg if there is one, or else the
+// buffer given by the pointer and length upvalues, i.e. the score mapped
+// in by main.c
+static const char *
+scoretext(lua_State *L, int arg, size_t *len)
+{
+	if (!lua_isnoneornil(L, arg))
+		return luaL_checklstring(L, arg, len);
+
+	const char *text = lua_touserdata(L, lua_upvalueindex(1));
+	*len = lua_tointeger(L, lua_upvalueindex(2));
+	if (!text)
+		luaL_error(L, "no score to parse");
+
+	return text;
+}
+
+// parse([text]) -> voices, stafforder
+int
+parse_score(lua_State *L)
+{
+	size_t len;
+	const char *text = scoretext(L, 1, &len);
+
+	parse_buffer(L, text, len);
+
+	return 2;
+}
+
+struct stream {
+	struct parser p;
+	lua_Integer voice;
+	bool invoice;
+};
+
+// iterator returned by parse_measures
+static int
+nextmeasure(lua_State *L)
+{
+	struct stream *s = lua_touserdata(L, lua_upvalueindex(1));
+	struct parser *p = &s->p;
+
+	p->L = L;
+
+	while (true) {
+		if (!s->invoice) {
+			skipspace(p);
+			if (atend(p))
+				return 0;
+
+			const char *name = NULL;
+			size_t len = command(p, &name);
+			if (!len)
+				luaL_error(L, "unknown token at offset %d", (int)p->i);
+			p->i += len + 1;
+
+			if (iscommand(name, len, "voice")) {
+				s->invoice = true;
+				s->voice++;
+			} else if (iscommand(name, len, "layout")) {
+				parselayout(p, lua_upvalueindex(2));
+			} else {
+				luaL_error(L, "unknown command \\%s", lua_pushlstring(L, name, len));
+			}
+			continue;
+		}
+
+		lua_newtable(L);
+		int measure = lua_gettop(L);
+		lua_Integer n = 0;
+		size_t start = p->i;
+		int r;
+
+		while ((r = nextitem(p, measure, &n)) == ITEM)
+			;
+
+		if (r == TEXTEND) {
+			s->invoice = false;
+			return 0;
+		}
+
+		if (r == VOICEEND)
+			s->invoice = false;
+
+		if (n == 0) {
+			lua_pop(L, 1);
+			continue;
+		}
+
+		lua_pushinteger(L, s->voice);
+		lua_insert(L, -2);
+		lua_pushinteger(L, (lua_Integer)cache_hash(MEASURESEED, p->text + start, p->i - start));
+		return 3;
+	}
+}
+
+// parse_measures(stafforder, [text]) -> iterator
+// the iterator returns the index of the current voice, a table with its
+// items up to and including the next barline, parsing only that far, and
+// a hash of the source text of those items, so that measures can be
+// compared between runs without keeping a copy of the score.
+// staves named in a \layout block are appended to stafforder as they are
+// reached.
+int
+parse_measures(lua_State *L)
+{
+	size_t len;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	const char *text = scoretext(L, 2, &len);
+	lua_settop(L, 2);
+
+	struct stream *s = lua_newuserdata(L, sizeof(*s));
+	s->p = (struct parser){L, text, len, 0};
+	s->voice = 0;
+	s->invoice = false;
+
+	// the text argument, if any, is kept as an upvalue so that it stays alive
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushcclosure(L, nextmeasure, 3);
+
+	return 1;
+}
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// sampling profiler for the lua side, which is where layout and most of
+// drawing happen.
+//
+// a timer on the cpu time of the thread running lua sends it a signal
+// every millisecond. if it is between profile_enter and profile_leave, the
+// signal arms a hook for the next lua instruction, which charges the lua
+// stack with a millisecond for every signal since the last sample and
+// disarms itself, so lua runs at full speed between samples. time spent
+// in C functions called from lua, such as glyph_extents or the rational
+// arithmetic, keeps counting signals until lua runs again, and so goes to
+// the lua code that called them, while time spent encoding outside of lua
+// isn't sampled.
+//
+// stacks are written in the collapsed format flamegraph tools read: one
+// line per distinct stack, outermost frame first, separated by semicolons
+// and followed by the microseconds spent in it. every function is named
+// with where it is defined, and the innermost one is followed by the line
+// that was running.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define INTERVAL 1000000 // nanoseconds
+#define MAXDEPTH 64
+#define MAXSTACK 4096
+
+struct sample {
+	char *stack;
+	uint64_t hash;
+	double time;
+};
+
+static bool enabled;
+static timer_t timer;
+static lua_State *profiled;
+static volatile sig_atomic_t inlua;
+// signals since the last sample, while in lua
+static volatile sig_atomic_t pending;
+
+static struct sample *samples;
+static size_t nsamples;
+static size_t samplecap;
+
+static uint64_t
+hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+static bool
+insert(struct sample *table, size_t cap, char *stack, uint64_t h, double time)
+{
+	for (size_t i = h & (cap - 1);; i = (i + 1) & (cap - 1)) {
+		if (!table[i].stack) {
+			table[i] = (struct sample){stack, h, time};
+			return true;
+		}
+		if (table[i].hash == h && strcmp(table[i].stack, stack) == 0) {
+			table[i].time += time;
+			return false;
+		}
+	}
+}
+
+// charge time to stack, taking ownership of it
+static void
+charge(char *stack, double time)
+{
+	// keep the table at most half full
+	if (2 * (nsamples + 1) > samplecap) {
+		size_t cap = samplecap ? 2 * samplecap : 1024;
+		struct sample *table = calloc(cap, sizeof(*table));
+		if (!table) {
+			free(stack);
+			return;
+		}
+		for (size_t i = 0; i < samplecap; i++) {
+			if (samples[i].stack)
+				insert(table, cap, samples[i].stack, samples[i].hash, samples[i].time);
+		}
+		free(samples);
+		samples = table;
+		samplecap = cap;
+	}
+
+	if (insert(samples, samplecap, stack, hash(stack), time))
+		nsamples++;
+	else
+		free(stack);
+}
+
+// append frame to the stack in buf, which holds len bytes so far
+static size_t
+addframe(char *buf, size_t len, const char *frame)
+{
+	if (len && len < MAXSTACK - 1)
+		buf[len++] = ';';
+
+	// flamegraph tools split frames on semicolons and stacks on newlines,
+	// so neither can appear in a frame
+	for (; *frame && len < MAXSTACK - 1; frame++)
+		buf[len++] = *frame == ';' || *frame == '\n' ? ' ' : *frame;
+
+	return len;
+}
+
+static void
+hook(lua_State *L, lua_Debug *ar)
+{
+	(void)ar;
+	lua_sethook(L, NULL, 0, 0);
+	// taken and cleared in one step, so that a tick landing in between
+	// isn't lost
+	int ticks = __atomic_exchange_n(&pending, 0, __ATOMIC_RELAXED);
+	if (ticks <= 0)
+		return;
+
+	// collect the frames innermost first, then write them outermost first
+	lua_Debug frames[MAXDEPTH];
+	int depth = 0;
+	while (depth < MAXDEPTH && lua_getstack(L, depth, &frames[depth])) {
+		lua_getinfo(L, "Sln", &frames[depth]);
+		depth++;
+	}
+
+	char buf[MAXSTACK];
+	char frame[LUA_IDSIZE + 64];
+	size_t len = 0;
+	for (int i = depth - 1; i >= 0; i--) {
+		lua_Debug *f = &frames[i];
+		const char *name = f->name ? f->name : "function";
+		if (*f->what == 'C')
+			snprintf(frame, sizeof(frame), "%s [C]", name);
+		else if (*f->what == 'm')
+			snprintf(frame, sizeof(frame), "main chunk %s", f->short_src);
+		else
+			snprintf(frame, sizeof(frame), "%s %s:%d", name, f->short_src, f->linedefined);
+		len = addframe(buf, len, frame);
+	}
+	if (depth && frames[0].currentline > 0) {
+		snprintf(frame, sizeof(frame), "%s:%d", frames[0].short_src, frames[0].currentline);
+		len = addframe(buf, len, frame);
+	}
+	buf[len] = '\0';
+
+	char *stack = strdup(buf);
+	if (stack)
+		charge(stack, ticks * (INTERVAL / 1e9));
+}
+
+static void
+tick(int sig)
+{
+	(void)sig;
+	// lua_sethook is safe to call from a signal handler
+	// the kernel only checks cpu timers every scheduler tick, so one
+	// signal can stand for several intervals
+	if (inlua) {
+		int overrun = timer_getoverrun(timer);
+		pending += 1 + (overrun > 0 ? overrun : 0);
+		lua_sethook(profiled, hook, LUA_MASKCOUNT, 1);
+	}
+}
+
+// sample L from then on whenever it runs. it must only be run from the
+// calling thread.
+void
+profile_start(lua_State *L)
+{
+	struct sigaction sa = {0};
+	sa.sa_handler = tick;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	// direct the signal at this thread, so that it never lands on one of
+	// the encoder's threads while this one is running lua
+	struct sigevent sev = {0};
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = gettid();
+
+	struct itimerspec its = {{0, INTERVAL}, {0, INTERVAL}};
+	if (sigaction(SIGPROF, &sa, NULL) < 0 ||
+			timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) < 0 ||
+			timer_settime(timer, 0, &its, NULL) < 0) {
+		fprintf(stderr, "failed to start profiler\n");
+		return;
+	}
+
+	profiled = L;
+	enabled = true;
+}
+
+// mark the start of a call into lua
+void
+profile_enter(void)
+{
+	inlua = 1;
+}
+
+// mark the end of a call into lua, disarming any sample that didn't reach
+// lua in time
+void
+profile_leave(void)
+{
+	inlua = 0;
+	pending = 0;
+	if (enabled)
+		lua_sethook(profiled, NULL, 0, 0);
+}
+
+// write the collapsed stacks to path
+void
+profile_report(const char *path)
+{
+	if (!enabled)
+		return;
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return;
+	}
+
+	for (size_t i = 0; i < samplecap; i++) {
+		if (samples[i].stack)
+			fprintf(f, "%s %.0f\n", samples[i].stack, samples[i].time * 1e6);
+	}
+
+	if (fclose(f) != 0)
+		fprintf(stderr, "failed to write %s\n", path);
+}
@@ -0,0 +1,72 @@
+-- a voice cut off by the end of the score keeps its complete measures,
+-- whether the score is parsed whole with parse or streamed into placement
+-- with parse_measures.
+--
+-- run with: ./smallpond --script test/truncated.lua
+
+-- a canonical string for an item, with its keys in order and rationals in
+-- their reduced form
+local function show(v)
+	if type(v) == "table" then
+		local keys = {}
+		for k in pairs(v) do
+			table.insert(keys, k)
+		end
+		table.sort(keys, function(a, b) return tostring(a) < tostring(b) end)
+		local parts = {}
+		for _, k in ipairs(keys) do
+			table.insert(parts, tostring(k) .. "=" .. show(v[k]))
+		end
+		return "{" .. table.concat(parts, " ") .. "}"
+	elseif type(v) == "userdata" then
+		return Q.tostring(v)
+	end
+	return tostring(v)
+end
+
+-- the voices of text as parse has them, and as the measures parse_measures
+-- returns add up to
+local function whole(text)
+	local voices = parse(text)
+	local shown = {}
+	for i, voice in ipairs(voices) do
+		shown[i] = {}
+		for _, item in ipairs(voice) do
+			table.insert(shown[i], show(item))
+		end
+	end
+	return shown
+end
+
+local function streamed(text)
+	local shown = {}
+	for voice, measure in parse_measures({}, text) do
+		shown[voice] = shown[voice] or {}
+		for _, item in ipairs(measure) do
+			table.insert(shown[voice], show(item))
+		end
+	end
+	return shown
+end
+
+local function check(name, text, lengths)
+	local a, b = whole(text), streamed(text)
+	assert(#a == #lengths, name .. ": parse has " .. #a .. " voices")
+	assert(#b == #lengths, name .. ": parse_measures has " .. #b .. " voices")
+	for i, n in ipairs(lengths) do
+		assert(#a[i] == n, name .. ": parse has " .. #a[i] .. " items in voice " .. i)
+		assert(#b[i] == n, name .. ": parse_measures has " .. #b[i] .. " items in voice " .. i)
+		for j = 1, n do
+			assert(a[i][j] == b[i][j], name .. ": item " .. j .. " of voice " .. i .. " differs: " .. a[i][j] .. " and " .. b[i][j])
+		end
+	end
+end
+
+check("complete", "\\voice a4 b4 | c4 d4 | \\end\n", {6})
+check("cut off mid measure", "\\voice a4 b4 | c4 d4 | e4 f4\n", {6})
+check("cut off after a barline", "\\voice a4 b4 | c4 d4 |\n", {6})
+check("cut off before a barline", "\\voice a4 b4 c4\n", {})
+check("second voice cut off", "\\voice \\staff high a4 | b4 \\end \\voice \\staff low c4 | d4\n", {4, 3})
+
+print("ok")
+os.exit(0)
@@ -0,0 +1,369 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// timing of the stages of rendering each frame and of the phases of
+// startup, on the monotonic clock, along with counts of the work done and
+// the peak memory use.
+//
+// stages, phases and counters are named by the caller and registered the
+// first time they are seen, so that adding one only needs a call where it
+// happens. each frame gets a record of the time spent in each stage and of
+// its counts, which is kept until exit and then summarized, and optionally
+// written out as CSV or, if the file name ends in .json, as JSON. counts
+// from before the first frame are reported with the phases.
+
+#define MAXSTAGES 16
+#define MAXPHASES 16
+#define MAXCOUNTERS 16
+
+static bool enabled;
+static const char *outpath;
+
+static const char *stages[MAXSTAGES];
+static int nstages;
+
+static const char *phases[MAXPHASES];
+static double phasetimes[MAXPHASES];
+static int nphases;
+
+static const char *counters[MAXCOUNTERS];
+static double startcounts[MAXCOUNTERS];
+static int ncounters;
+
+// the frame number, stage times and counts of every frame, with MAXSTAGES
+// times and MAXCOUNTERS counts per frame
+static long *framenums;
+static double *records;
+static double *counts;
+static size_t nframes;
+static size_t framecap;
+
+// record timings until exit, writing every frame's to path if it isn't NULL
+void
+timing_enable(const char *path)
+{
+	enabled = true;
+	if (path)
+		outpath = path;
+}
+
+// the current time in seconds
+double
+timing_now(void)
+{
+	struct timespec ts;
+	if (!enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+lookup(const char **names, int *n, int max, const char *name)
+{
+	for (int i = 0; i < *n; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	if (*n == max)
+		return -1;
+	names[*n] = name;
+	return (*n)++;
+}
+
+// start the record of frame n
+void
+timing_frame(long n)
+{
+	if (!enabled)
+		return;
+
+	if (nframes == framecap) {
+		size_t cap = framecap ? 2 * framecap : 1024;
+		long *f = realloc(framenums, cap * sizeof(*f));
+		if (f)
+			framenums = f;
+		double *r = realloc(records, cap * MAXSTAGES * sizeof(*r));
+		if (r)
+			records = r;
+		double *c = realloc(counts, cap * MAXCOUNTERS * sizeof(*c));
+		if (c)
+			counts = c;
+		if (!f || !r || !c) {
+			fprintf(stderr, "out of memory for timings, no longer recording them\n");
+			enabled = false;
+			return;
+		}
+		framecap = cap;
+	}
+
+	framenums[nframes] = n;
+	memset(records + nframes * MAXSTAGES, 0, MAXSTAGES * sizeof(*records));
+	memset(counts + nframes * MAXCOUNTERS, 0, MAXCOUNTERS * sizeof(*counts));
+	nframes++;
+}
+
+// add the time since start to stage in the current frame. a stage can be
+// entered several times in a frame, such as when the encoder gives back
+// more than one packet.
+void
+timing_stage(const char *stage, double start)
+{
+	if (!enabled || !nframes)
+		return;
+
+	double t = timing_now() - start;
+	int i = lookup(stages, &nstages, MAXSTAGES, stage);
+	if (i >= 0)
+		records[(nframes - 1) * MAXSTAGES + i] += t;
+}
+
+// add the time since start to a phase outside of the frames
+void
+timing_phase(const char *phase, double start)
+{
+	if (!enabled)
+		return;
+
+	double t = timing_now() - start;
+	int i = lookup(phases, &nphases, MAXPHASES, phase);
+	if (i >= 0)
+		phasetimes[i] += t;
+}
+
+// add n to counter in the current frame, or to the counts from startup
+void
+timing_count(const char *counter, double n)
+{
+	if (!enabled)
+		return;
+
+	int i = lookup(counters, &ncounters, MAXCOUNTERS, counter);
+	if (i < 0)
+		return;
+	if (nframes)
+		counts[(nframes - 1) * MAXCOUNTERS + i] += n;
+	else
+		startcounts[i] += n;
+}
+
+// the peak resident memory of the process in bytes
+static double
+peakrss(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return ru.ru_maxrss * 1024.0;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// the nearest-rank percentile p of the sorted values
+static double
+percentile(const double *sorted, size_t n, double p)
+{
+	// the smallest value with at least p percent of them at or below it
+	double rank = ceil(p / 100 * n) - 1;
+	if (rank < 0)
+		rank = 0;
+	if (rank > n - 1)
+		rank = n - 1;
+	return sorted[(size_t)rank];
+}
+
+struct summary {
+	double total;
+	double p50;
+	double p95;
+	double p99;
+	double max;
+};
+
+// summarize the values of all frames, which are sorted in place
+static void
+summarize(double *v, struct summary *s)
+{
+	s->total = 0;
+	for (size_t f = 0; f < nframes; f++)
+		s->total += v[f];
+
+	qsort(v, nframes, sizeof(*v), compare);
+	s->p50 = percentile(v, nframes, 50);
+	s->p95 = percentile(v, nframes, 95);
+	s->p99 = percentile(v, nframes, 99);
+	s->max = v[nframes - 1];
+}
+
+// summarize stage i over all frames, or the frame total if i is nstages
+static bool
+summarizestage(int i, struct summary *s)
+{
+	double *v = malloc(nframes * sizeof(*v));
+	if (!v)
+		return false;
+
+	for (size_t f = 0; f < nframes; f++) {
+		const double *r = records + f * MAXSTAGES;
+		v[f] = 0;
+		for (int j = 0; j < nstages; j++) {
+			if (j == i || i == nstages)
+				v[f] += r[j];
+		}
+	}
+
+	summarize(v, s);
+	free(v);
+	return true;
+}
+
+// summarize counter i over all frames
+static bool
+summarizecount(int i, struct summary *s)
+{
+	double *v = malloc(nframes * sizeof(*v));
+	if (!v)
+		return false;
+
+	for (size_t f = 0; f < nframes; f++)
+		v[f] = counts[f * MAXCOUNTERS + i];
+
+	summarize(v, s);
+	free(v);
+	return true;
+}
+
+static void
+writecsv(FILE *f)
+{
+	fprintf(f, "frame");
+	for (int i = 0; i < nstages; i++)
+		fprintf(f, ",%s", stages[i]);
+	fprintf(f, ",total");
+	for (int i = 0; i < ncounters; i++)
+		fprintf(f, ",%s", counters[i]);
+	fprintf(f, "\n");
+
+	for (size_t n = 0; n < nframes; n++) {
+		const double *r = records + n * MAXSTAGES;
+		double total = 0;
+		fprintf(f, "%ld", framenums[n]);
+		for (int i = 0; i < nstages; i++) {
+			fprintf(f, ",%.9f", r[i]);
+			total += r[i];
+		}
+		fprintf(f, ",%.9f", total);
+		for (int i = 0; i < ncounters; i++)
+			fprintf(f, ",%.0f", counts[n * MAXCOUNTERS + i]);
+		fprintf(f, "\n");
+	}
+}
+
+static void
+writejson(FILE *f)
+{
+	fprintf(f, "{\n\t\"peakrss\": %.0f,\n\t\"phases\": {", peakrss());
+	for (int i = 0; i < nphases; i++)
+		fprintf(f, "%s\n\t\t\"%s\": %.9f", i ? "," : "", phases[i], phasetimes[i]);
+	fprintf(f, "\n\t},\n\t\"startcounts\": {");
+	for (int i = 0; i < ncounters; i++)
+		fprintf(f, "%s\n\t\t\"%s\": %.0f", i ? "," : "", counters[i], startcounts[i]);
+	fprintf(f, "\n\t},\n\t\"summary\": {");
+	for (int i = 0; i <= nstages && nframes; i++) {
+		struct summary s;
+		if (!summarizestage(i, &s))
+			break;
+		fprintf(f, "%s\n\t\t\"%s\": {\"total\": %.9f, \"p50\": %.9f, \"p95\": %.9f, \"p99\": %.9f, \"max\": %.9f}",
+			i ? "," : "", i < nstages ? stages[i] : "total", s.total, s.p50, s.p95, s.p99, s.max);
+	}
+	fprintf(f, "\n\t},\n\t\"countsummary\": {");
+	for (int i = 0; i < ncounters && nframes; i++) {
+		struct summary s;
+		if (!summarizecount(i, &s))
+			break;
+		fprintf(f, "%s\n\t\t\"%s\": {\"total\": %.0f, \"p50\": %.0f, \"p95\": %.0f, \"p99\": %.0f, \"max\": %.0f}",
+			i ? "," : "", counters[i], s.total, s.p50, s.p95, s.p99, s.max);
+	}
+	fprintf(f, "\n\t},\n\t\"stages\": [");
+	for (int i = 0; i < nstages; i++)
+		fprintf(f, "%s\"%s\"", i ? ", " : "", stages[i]);
+	fprintf(f, "],\n\t\"counters\": [");
+	for (int i = 0; i < ncounters; i++)
+		fprintf(f, "%s\"%s\"", i ? ", " : "", counters[i]);
+	fprintf(f, "],\n\t\"frames\": [");
+	for (size_t n = 0; n < nframes; n++) {
+		const double *r = records + n * MAXSTAGES;
+		fprintf(f, "%s\n\t\t[%ld", n ? "," : "", framenums[n]);
+		for (int i = 0; i < nstages; i++)
+			fprintf(f, ", %.9f", r[i]);
+		for (int i = 0; i < ncounters; i++)
+			fprintf(f, ", %.0f", counts[n * MAXCOUNTERS + i]);
+		fprintf(f, "]");
+	}
+	fprintf(f, "\n\t]\n}\n");
+}
+
+// print a summary of the timings to stderr, and write every frame's to the
+// file given to timing_enable
+void
+timing_report(void)
+{
+	if (!enabled)
+		return;
+
+	fprintf(stderr, "peak rss %.1f MB\n\n", peakrss() / (1 << 20));
+	fprintf(stderr, "%-10s %10s\n", "phase", "ms");
+	for (int i = 0; i < nphases; i++)
+		fprintf(stderr, "%-10s %10.3f\n", phases[i], phasetimes[i] * 1e3);
+	for (int i = 0; i < ncounters; i++) {
+		if (startcounts[i])
+			fprintf(stderr, "%-15s %10.0f calls before the first frame\n", counters[i], startcounts[i]);
+	}
+
+	if (nframes) {
+		fprintf(stderr, "\n%zu frames\n", nframes);
+		fprintf(stderr, "%-10s %10s %10s %10s %10s %10s %10s\n", "stage", "total ms", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+		for (int i = 0; i <= nstages; i++) {
+			struct summary s;
+			if (!summarizestage(i, &s))
+				break;
+			fprintf(stderr, "%-10s %10.1f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+				i < nstages ? stages[i] : "total", s.total * 1e3, s.total / nframes * 1e3,
+				s.p50 * 1e3, s.p95 * 1e3, s.p99 * 1e3, s.max * 1e3);
+		}
+
+		fprintf(stderr, "\n%-15s %10s %10s %10s %10s %10s %10s\n", "counter", "total", "mean", "p50", "p95", "p99", "max");
+		for (int i = 0; i < ncounters; i++) {
+			struct summary s;
+			if (!summarizecount(i, &s))
+				break;
+			fprintf(stderr, "%-15s %10.0f %10.1f %10.0f %10.0f %10.0f %10.0f\n",
+				counters[i], s.total, s.total / nframes, s.p50, s.p95, s.p99, s.max);
+		}
+	}
+
+	if (outpath) {
+		FILE *f = fopen(outpath, "w");
+		if (!f) {
+			fprintf(stderr, "failed to open %s\n", outpath);
+			return;
+		}
+		size_t len = strlen(outpath);
+		if (len >= 5 && strcmp(outpath + len - 5, ".json") == 0)
+			writejson(f);
+		else
+			writecsv(f);
+		if (fclose(f) != 0)
+			fprintf(stderr, "failed to write %s\n", outpath);
+	}
+}
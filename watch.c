@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cairo.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// live preview: keep everything loaded, re-run the script whenever one of
+// its inputs changes and play the animation into a ring of frames in
+// shared memory, which a viewer can map and display.
+//
+// the ring starts with a header, followed by the frames, each of which is
+// height rows of stride bytes in cairo's RGB24 format. count is the number
+// of frames written so far and is only updated once a frame is complete,
+// so the latest frame is in slot (count - 1) % slots.
+//
+// a reader that is slow to copy a frame out can have its slot written over
+// by a later one, so each slot also has a sequence number, which is odd
+// while the slot is being written. a reader reads it, copies the frame if
+// it was even, and reads it again: if it changed, the copy may be torn and
+// is taken again.
+
+#define RINGNAME "/smallpond"
+#define RINGMAGIC "spframe"
+#define RINGSLOTS 3
+
+struct ring {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t slots;
+	uint64_t count;
+	uint64_t seq[RINGSLOTS];
+};
+
+extern cairo_surface_t *surface;
+extern const char *scorepath, *scriptpath, *layoutpath;
+
+int loadscore(lua_State *L);
+int renderframe(lua_State *L, double time);
+int runscript(lua_State *L);
+
+// the inputs of the script, each with the watch on its directory
+static struct {
+	const char **path;
+	int wd;
+} watched[] = {{.path = &scorepath}, {.path = &layoutpath}, {.path = &scriptpath}};
+
+static struct ring *
+openring(void)
+{
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	size_t size = sizeof(struct ring) + (size_t)RINGSLOTS * stride * height;
+
+	int fd = shm_open(RINGNAME, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open frame ring: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		fprintf(stderr, "failed to size frame ring: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	struct ring *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "failed to map frame ring: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	memcpy(ring->magic, RINGMAGIC, sizeof(ring->magic));
+	ring->width = width;
+	ring->height = height;
+	ring->stride = stride;
+	ring->slots = RINGSLOTS;
+	for (int i = 0; i < RINGSLOTS; i++)
+		__atomic_store_n(&ring->seq[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->count, 0, __ATOMIC_RELEASE);
+
+	return ring;
+}
+
+static void
+putring(struct ring *ring)
+{
+	size_t framesize = (size_t)ring->stride * ring->height;
+	uint64_t count = ring->count;
+	unsigned char *slot = (unsigned char *)(ring + 1) + count % ring->slots * framesize;
+	uint64_t *seq = &ring->seq[count % ring->slots];
+
+	// the slot is marked as being written before any of it changes, and as
+	// done only once all of it has
+	uint64_t s = *seq;
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot, cairo_image_surface_get_data(surface), framesize);
+	__atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// read pending events, returning whether any of them were for watched files
+static bool
+changed(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool any = false;
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			for (size_t i = 0; ev->len && i < sizeof(watched) / sizeof(watched[0]); i++) {
+				const char *slash = strrchr(*watched[i].path, '/');
+				const char *name = slash ? slash + 1 : *watched[i].path;
+				if (ev->wd == watched[i].wd && strcmp(ev->name, name) == 0)
+					any = true;
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+
+	return any;
+}
+
+// reload the score and re-run the script. layout is only redone as far as
+// needed, since the cache holds the previous layout.
+static void
+reload(lua_State *L)
+{
+	if (loadscore(L) < 0)
+		return;
+
+	runscript(L);
+}
+
+int
+watch(lua_State *L, int framerate)
+{
+	// editors often replace files instead of writing them, so watch the
+	// directories rather than the files themselves. inotify gives the same
+	// watch to a directory added twice.
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed to watch for changes: %s\n", strerror(errno));
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof(watched) / sizeof(watched[0]); i++) {
+		const char *path = *watched[i].path;
+		const char *slash = strrchr(path, '/');
+		char dir[PATH_MAX] = ".";
+		if (slash)
+			snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+		watched[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (watched[i].wd < 0) {
+			fprintf(stderr, "failed to watch %s for changes: %s\n", dir, strerror(errno));
+			return 1;
+		}
+	}
+
+	struct ring *ring = openring();
+	if (!ring)
+		return 1;
+
+	fprintf(stderr, "watching for changes, frames are in /dev/shm%s\n", RINGNAME);
+
+	reload(L);
+
+	double time = 0;
+	bool playing = true;
+	while (true) {
+		if (playing) {
+			int r = renderframe(L, time);
+			if (r < 0) {
+				// wait for a fix rather than failing on every frame
+				playing = false;
+			} else {
+				putring(ring);
+				time = r ? 0 : time + 1.0 / framerate;
+			}
+		}
+
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int n = poll(&pfd, 1, playing ? 1000 / framerate : -1);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "failed to wait for changes: %s\n", strerror(errno));
+			return 1;
+		}
+
+		// keep the current time, so the edit shows up where it was made
+		if (n > 0 && changed(fd)) {
+			reload(L);
+			playing = true;
+		}
+	}
+}